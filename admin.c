@@ -0,0 +1,93 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "admin.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const struct admin_command *commands;
+static int listenfd;
+
+static void run(int fd, char *line) {
+	const struct admin_command *c;
+	char *args = line + strcspn(line, " \t");
+	if(*args) *args++ = 0;
+	args += strspn(args, " \t");
+	if(!*line) return;
+	if(!strcmp(line, "help")) {
+		for(c = commands; c->name; c++)
+			dprintf(fd, "%-8s %s\n", c->name, c->help);
+		return;
+	}
+	for(c = commands; c->name; c++)
+		if(!strcmp(line, c->name)) {
+			c->fn(fd, args);
+			return;
+		}
+	dprintf(fd, "error: unknown command %s, try help\n", line);
+}
+
+static void serve(int fd) {
+	char buf[1024];
+	size_t n = 0;
+	ssize_t r;
+	/* an idle admin session mustn't lock everybody else out */
+	struct timeval tv = {.tv_sec = 60};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	while((r = read(fd, buf + n, sizeof buf - 1 - n)) > 0) {
+		char *p = buf, *nl;
+		n += r;
+		buf[n] = 0;
+		while((nl = strchr(p, '\n'))) {
+			*nl = 0;
+			if(nl > p && nl[-1] == '\r') nl[-1] = 0;
+			run(fd, p);
+			p = nl + 1;
+		}
+		n -= p - buf;
+		memmove(buf, p, n);
+		if(n == sizeof buf - 1) {
+			dprintf(fd, "error: line too long\n");
+			return;
+		}
+	}
+}
+
+static void* adminthread(void *data) {
+	(void) data;
+	for(;;) {
+		int fd = accept(listenfd, 0, 0);
+		if(fd == -1) {
+			sleep(1);
+			continue;
+		}
+		serve(fd);
+		close(fd);
+	}
+	return 0;
+}
+
+int admin_setup(const char *path, const struct admin_command *cmds) {
+	struct sockaddr_un sa = {.sun_family = AF_UNIX};
+	if(strlen(path) >= sizeof sa.sun_path) return -1;
+	strcpy(sa.sun_path, path);
+	if((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+	unlink(path);
+	/* only the owner gets to kill connections and change limits */
+	mode_t old = umask(077);
+	int err = bind(listenfd, (struct sockaddr*) &sa, sizeof sa);
+	umask(old);
+	if(err || listen(listenfd, 4)) {
+		close(listenfd);
+		return -1;
+	}
+	commands = cmds;
+	pthread_t pt;
+	return pthread_create(&pt, 0, adminthread, 0);
+}
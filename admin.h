@@ -0,0 +1,23 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#pragma RcB2 DEP "admin.c"
+
+/* a unix domain socket taking line based commands, served one client at
+   a time by a thread of its own. e.g.:
+       echo list | socat - UNIX-CONNECT:/run/microsocks.sock
+
+   every line is split into the command name and the rest, which is
+   passed to the matching handler along with the client's descriptor to
+   write the reply to. "help" lists the commands. */
+
+struct admin_command {
+	const char *name, *help;
+	void (*fn)(int fd, char *args);
+};
+
+/* listen on path, replacing a stale socket there. cmds ends with an
+   entry whose name is 0. returns 0 on success. */
+int admin_setup(const char *path, const struct admin_command *cmds);
+
+#endif
@@ -0,0 +1,260 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "admission.h"
+#include "clock.h"
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+/* 1024 sets of 4 entries each, ~160 KB in bss. */
+#define ADM_WAYS 4
+#define ADM_SETS 1024
+/* tokens are stored in thousandths of a connection. */
+#define ADM_TOKEN 1000
+/* the most a bucket can hold without overflowing its tokens */
+#define ADM_BURST_MAX (UINT_MAX / ADM_TOKEN)
+
+struct adm_entry {
+	unsigned char key[16];
+	unsigned short af;
+	unsigned active;
+	unsigned tokens;
+	unsigned long long last;
+};
+
+static struct adm_entry table[ADM_SETS][ADM_WAYS];
+/* the limits may be changed by admission_set() from another thread */
+static atomic_uint adm_rate, adm_burst, adm_maxconn;
+static unsigned adm_seed;
+
+#define GET(X) atomic_load_explicit(&(X), memory_order_relaxed)
+#define SET(X, V) atomic_store_explicit(&(X), (V), memory_order_relaxed)
+
+/* burst defaults to rate, and is capped at ADM_BURST_MAX */
+static unsigned bucket_size(unsigned rate, unsigned burst) {
+	if(!burst) burst = rate;
+	return burst < ADM_BURST_MAX ? burst : ADM_BURST_MAX;
+}
+
+void admission_setup(unsigned rate, unsigned burst, unsigned maxconn) {
+	SET(adm_rate, rate);
+	SET(adm_burst, bucket_size(rate, burst));
+	SET(adm_maxconn, maxconn);
+	/* seed the hash so clients can't aim for a single set */
+	adm_seed = (unsigned) clock_us() ^ ((unsigned) getpid() << 16);
+}
+
+static int make_key(const union sockaddr_union *addr, unsigned char key[16]) {
+	static const unsigned char v4mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+	int af = SOCKADDR_UNION_AF(addr);
+	memset(key, 0, 16);
+	if(af == AF_INET) {
+		memcpy(key, &addr->v4.sin_addr, 4);
+	} else if(af == AF_INET6) {
+		const unsigned char *a = addr->v6.sin6_addr.s6_addr;
+		if(!memcmp(a, v4mapped, 12)) {
+			memcpy(key, a + 12, 4);
+			af = AF_INET;
+		} else
+			memcpy(key, a, 8);
+	} else return 0;
+	return af;
+}
+
+static unsigned hash_key(const unsigned char key[16], int af) {
+	unsigned h = 2166136261u ^ adm_seed, i;
+	for(i = 0; i < 16; i++)
+		h = (h ^ key[i]) * 16777619u;
+	h = (h ^ af) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+/* prefer empty slots, then idle entries, then the least recently seen. */
+static int better_victim(struct adm_entry *a, struct adm_entry *b) {
+	if(!b) return 1;
+	if(!a->af || !b->af) return !a->af && b->af;
+	if(!a->active != !b->active) return !a->active;
+	return a->last < b->last;
+}
+
+static struct adm_entry* lookup(const union sockaddr_union *addr, int create) {
+	unsigned char key[16];
+	int af = make_key(addr, key);
+	if(!af) return 0;
+	struct adm_entry *set = table[hash_key(key, af) % ADM_SETS], *victim = 0;
+	size_t i;
+	for(i = 0; i < ADM_WAYS; i++) {
+		struct adm_entry *e = &set[i];
+		if(e->af == af && !memcmp(e->key, key, 16)) return e;
+		if(better_victim(e, victim)) victim = e;
+	}
+	if(!create) return 0;
+	/* evicting an entry with open connections forgets their count; that
+	   only happens if a whole set is busy, and merely relaxes the limit. */
+	memset(victim, 0, sizeof *victim);
+	memcpy(victim->key, key, 16);
+	victim->af = af;
+	victim->tokens = GET(adm_burst) * ADM_TOKEN;
+	victim->last = clock_ms();
+	return victim;
+}
+
+int admission_check(const union sockaddr_union *addr, int *counted) {
+	unsigned rate = GET(adm_rate), burst = GET(adm_burst), maxconn = GET(adm_maxconn);
+	*counted = 0;
+	if(!rate && !maxconn) return 1;
+	struct adm_entry *e = lookup(addr, 1);
+	if(!e) return 1;
+	unsigned long long now = clock_ms();
+	if(rate) {
+		unsigned long long t = e->tokens + (now - e->last) * rate;
+		e->tokens = t > burst * ADM_TOKEN ? burst * ADM_TOKEN : t;
+	}
+	e->last = now;
+	if(maxconn && e->active >= maxconn) return 0;
+	if(rate) {
+		if(e->tokens < ADM_TOKEN) return 0;
+		e->tokens -= ADM_TOKEN;
+	}
+	e->active++;
+	*counted = 1;
+	return 1;
+}
+
+void admission_release(const union sockaddr_union *addr) {
+	struct adm_entry *e = lookup(addr, 0);
+	if(e && e->active) e->active--;
+}
+
+/* descriptors kept free for listeners, logging and the like. */
+#define FD_RESERVE 16
+#define BACKOFF_MIN 16
+#define BACKOFF_MAX 1024
+
+/* max_active is the smaller of the configured maxconn and fdcap */
+static atomic_size_t max_active;
+static size_t fdcap = (size_t) -1;
+static atomic_uint maxconn_set;
+static unsigned long long backoff_until;
+static unsigned backoff_ms;
+
+static atomic_ullong codel_target, codel_interval;
+static unsigned long long first_above, drop_next;
+static unsigned drop_count, dropping;
+static atomic_ullong sojourn_us, sojourn_at;
+
+void admission_limits(unsigned maxconn, unsigned target, unsigned interval) {
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		/* the soft limit is often far below what we're allowed to use */
+		if(rl.rlim_cur < rl.rlim_max) {
+			rlim_t cur = rl.rlim_cur;
+			rl.rlim_cur = rl.rlim_max;
+			if(setrlimit(RLIMIT_NOFILE, &rl)) rl.rlim_cur = cur;
+		}
+		if(rl.rlim_cur != RLIM_INFINITY)
+			fdcap = rl.rlim_cur > FD_RESERVE * 2 ?
+				(rl.rlim_cur - FD_RESERVE) / 2 : 1;
+	}
+	struct admission_params p;
+	admission_get(&p);
+	p.maxconn = maxconn;
+	p.codel_target = target;
+	p.codel_interval = interval;
+	admission_set(&p);
+}
+
+void admission_get(struct admission_params *p) {
+	p->rate = GET(adm_rate);
+	p->burst = GET(adm_burst);
+	p->ip_maxconn = GET(adm_maxconn);
+	p->maxconn = GET(maxconn_set);
+	p->codel_target = GET(codel_target) / 1000;
+	p->codel_interval = GET(codel_interval) / 1000;
+}
+
+void admission_set(const struct admission_params *p) {
+	size_t max = p->maxconn ? p->maxconn : (size_t) -1;
+	SET(adm_rate, p->rate);
+	SET(adm_burst, bucket_size(p->rate, p->burst));
+	SET(adm_maxconn, p->ip_maxconn);
+	SET(maxconn_set, p->maxconn);
+	SET(max_active, max < fdcap ? max : fdcap);
+	SET(codel_target, p->codel_target * 1000ULL);
+	SET(codel_interval, (p->codel_interval ? p->codel_interval : 100) * 1000ULL);
+}
+
+int admission_wait(size_t active) {
+	if(backoff_until) {
+		unsigned long long now = clock_ms();
+		if(now < backoff_until) return backoff_until - now;
+		backoff_until = 0;
+	}
+	return active >= GET(max_active) ? -1 : 0;
+}
+
+void admission_failure(void) {
+	backoff_ms = backoff_ms ? backoff_ms * 2 : BACKOFF_MIN;
+	if(backoff_ms > BACKOFF_MAX) backoff_ms = BACKOFF_MAX;
+	backoff_until = clock_ms() + backoff_ms;
+}
+
+void admission_success(void) {
+	backoff_ms = 0;
+}
+
+void admission_sojourn(unsigned long long us) {
+	atomic_store_explicit(&sojourn_us, us, memory_order_relaxed);
+	atomic_store_explicit(&sojourn_at, clock_us(), memory_order_relaxed);
+}
+
+static unsigned long long isqrt(unsigned long long x) {
+	unsigned long long r = 0, b = 1ULL << 62;
+	while(b > x) b >>= 2;
+	for(; b; b >>= 2) {
+		if(x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else r >>= 1;
+	}
+	return r;
+}
+
+static unsigned long long control_law(unsigned long long t) {
+	return t + GET(codel_interval) / isqrt(drop_count);
+}
+
+/* the CoDel state machine from rfc 8289, with "dequeue" being a worker
+   picking up a connection and "drop" being a rejected connection. */
+int admission_shed(void) {
+	unsigned long long target = GET(codel_target), interval = GET(codel_interval);
+	if(!target) return 0;
+	unsigned long long now = clock_us();
+	unsigned long long s = atomic_load_explicit(&sojourn_us, memory_order_relaxed);
+	unsigned long long at = atomic_load_explicit(&sojourn_at, memory_order_relaxed);
+	/* a measurement from before the last interval says nothing about now */
+	if(s < target || now - at > interval) {
+		first_above = 0;
+		dropping = 0;
+		return 0;
+	}
+	if(!first_above) {
+		first_above = now + interval;
+		return 0;
+	}
+	if(!dropping) {
+		if(now < first_above) return 0;
+		dropping = 1;
+		/* resume close to the previous drop rate if we were dropping recently */
+		drop_count = drop_count > 2 && now - drop_next < 16 * interval ?
+			drop_count - 2 : 1;
+		drop_next = control_law(now);
+		return 1;
+	}
+	if(now < drop_next) return 0;
+	drop_count++;
+	drop_next = control_law(drop_next);
+	return 1;
+}
@@ -0,0 +1,73 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "server.h"
+
+#pragma RcB2 DEP "admission.c"
+
+/* per source address admission control, done right after accept() so that
+   rejected connections cost nothing but the close().
+
+   every address gets a token bucket refilled with `rate` connections per
+   second and holding up to `burst` tokens (at most about 4 million),
+   plus a counter of connections currently open, capped at `maxconn`. a
+   value of 0 disables that check.
+   ipv6 clients are keyed by their /64, since that is what a single host
+   usually gets to pick addresses from.
+
+   the table has a fixed size; when a set is full the least recently seen
+   idle entry is evicted. all functions must be called from the same thread. */
+
+void admission_setup(unsigned rate, unsigned burst, unsigned maxconn);
+
+/* returns 1 if a connection from addr may proceed, 0 if it must be
+   rejected. *counted tells whether an admitted connection took a slot of
+   its address; those, and only those, must later be passed to
+   admission_release(), whatever the limits are by then. */
+int admission_check(const union sockaddr_union *addr, int *counted);
+void admission_release(const union sockaddr_union *addr);
+
+/* global admission control, also driven from the accepting thread.
+
+   maxconn caps the number of concurrent connections (0: no cap); the
+   cap is further lowered to what fits into RLIMIT_NOFILE, counting two
+   descriptors per connection. when at the cap, or while backing off after
+   a resource failure, accept() is not called at all and new clients wait
+   in the kernel's listen backlog.
+
+   codel_target and codel_interval (milliseconds, 0: disabled) enable
+   CoDel-style load shedding: once the queueing delay of new connections,
+   as reported by admission_sojourn(), stayed above the target for a whole
+   interval, new connections are rejected at an increasing rate until
+   the delay drops again. */
+void admission_limits(unsigned maxconn, unsigned codel_target, unsigned codel_interval);
+
+/* returns 0 if another connection may be accepted with `active` ones
+   currently open, otherwise the number of milliseconds to wait before
+   asking again, or -1 to wait until a connection goes away. */
+int admission_wait(size_t active);
+
+/* returns 1 if the connection just accepted should be shed. */
+int admission_shed(void);
+
+/* report that a resource allocation failed, or that a connection was
+   set up successfully. failures pause accepting with exponential backoff. */
+void admission_failure(void);
+void admission_success(void);
+
+/* the limits given to admission_setup() and admission_limits(), which
+   may be read and changed from any thread while running. new limits apply
+   to connections accepted from then on. */
+struct admission_params {
+	unsigned rate, burst, ip_maxconn;
+	unsigned maxconn, codel_target, codel_interval;
+};
+void admission_get(struct admission_params *p);
+void admission_set(const struct admission_params *p);
+
+/* called by worker threads with the time in microseconds a new connection
+   waited to be picked up, in the listen backlog and after accept().
+   thread-safe. */
+void admission_sojourn(unsigned long long us);
+
+#endif
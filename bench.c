@@ -0,0 +1,860 @@
+/*
+   microsocks-bench - a socks5 load generator with a built-in target
+   server, measuring a proxy over loopback. every scenario prints one
+   json line to stdout, so results can be kept and compared between
+   builds:
+
+   cps        short connections (connect, handshake, one byte echoed)
+              per second, with -c clients
+   handshake  the same with -n concurrent clients, for the handshake
+              latency under load
+   stream     throughput of a single download
+   streams    aggregate throughput of -m concurrent downloads
+   idle       memory cost of -k idle relayed connections: the growth of
+              the proxy's rss and thread count (from /proc, when its pid
+              is known) and of the kernel's tcp socket memory (from
+              /proc/net/sockstat, which counts both ends on loopback),
+              checked against a budget per connection given with -B
+   replay     the connections of a trace recorded with microsocks -x
+              (see trace.h), with their arrival times, handshake types,
+              lifetimes and bytes over time in both directions, at -R
+              times the original speed. the bytes of every time bucket
+              are spread evenly over it.
+
+   the handshake latency is the time from connect() to the socks reply
+   for the CONNECT request. when the proxy's pid is known, cps, handshake,
+   stream and streams also report the cpu time it used, in total and per
+   gigabyte relayed, e.g. to compare microsocks -Z with the copying path
+   (make bench-zerocopy).
+*/
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "clock.h"
+#include "sblist.h"
+#include "trace.h"
+
+#define BUF_SIZE (64*1024)
+#define THREAD_STACK_SIZE (128*1024)
+
+/* what the target server does with a connection, chosen by its first byte */
+enum mode {
+	MODE_ECHO = 'e', /* send the byte back and close */
+	MODE_SOURCE = 's', /* send data until the client goes away */
+	MODE_REPLAY = 'r', /* replay the trace record that follows */
+};
+
+static struct addrinfo *proxy;
+/* the target server, and a listener that just holds on to connections */
+static struct sockaddr_in target, hold;
+static sblist held;
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int stop;
+static int duration = 5;
+static char source[BUF_SIZE];
+/* for replaying connections that authenticated with a password */
+static const char *auth_user, *auth_pass;
+
+struct worker {
+	pthread_t pt;
+	/* handshake latencies, uint32_t us */
+	sblist lat;
+	unsigned long long ops, errors, bytes;
+};
+
+static void msleep(long ms) {
+	struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000};
+	nanosleep(&ts, 0);
+}
+
+static int start_thread(pthread_t *pt, void *(*fn)(void*), void *arg) {
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+	int ret = pthread_create(pt, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+static int read_full(int fd, void *buf, size_t n) {
+	char *p = buf;
+	while(n) {
+		ssize_t r = read(fd, p, n);
+		if(r <= 0) return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n) {
+	const char *p = buf;
+	while(n) {
+		ssize_t w = write(fd, p, n);
+		if(w <= 0) return -1;
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+/* the bytes in direction dir that are due ms after accept. every
+   bucket's bytes are spread evenly over it, the last one ends with the
+   connection. */
+static unsigned long long due(const struct trace_conn *c, int dir, double ms) {
+	double life = c->lifetime / 1000.;
+	unsigned long long sum = 0;
+	unsigned b;
+	for(b = 0; b < TRACE_BUCKETS; b++) {
+		unsigned long long n = c->bytes[b][dir];
+		double start = trace_bucket_start(b);
+		double end = b + 1 < TRACE_BUCKETS ? trace_bucket_start(b + 1) : life;
+		if(!n || ms < start) continue;
+		if(end > life) end = life;
+		if(ms >= end) sum += n;
+		else sum += n * ((ms - start) / (end - start));
+	}
+	return sum;
+}
+
+/* replays direction dir of c on fd, at speed, counting from base, and
+   reads what the other side sends meanwhile. the client side is done
+   once its lifetime is over and it got everything, the target side once
+   the client closed. returns 0 or -1, *moved gets the bytes moved. */
+static int pump(int fd, const struct trace_conn *c, int dir, double speed,
+                unsigned long long base, unsigned long long *moved) {
+	unsigned long long total = 0, expect = 0, sent = 0, got = 0;
+	unsigned long long life = c->lifetime / speed;
+	int eof = 0, ret = -1;
+	unsigned b;
+	char *buf = malloc(BUF_SIZE);
+	for(b = 0; b < TRACE_BUCKETS; b++) {
+		total += c->bytes[b][dir];
+		expect += c->bytes[b][!dir];
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	while(buf) {
+		unsigned long long now = clock_us() - base;
+		unsigned long long want = due(c, dir, now * speed / 1000);
+		if(sent == total && (dir == TRACE_UP ? got >= expect && now >= life : eof)) {
+			ret = 0;
+			break;
+		}
+		/* the client closing early, or a proxy that lost data */
+		if(eof || now > life + 30000000ULL) break;
+		struct pollfd p = {.fd = fd, .events = POLLIN | (want > sent ? POLLOUT : 0)};
+		if(poll(&p, 1, want > sent ? 1000 : 10) == -1 && errno != EINTR) break;
+		if(p.revents & (POLLIN|POLLHUP|POLLERR)) {
+			ssize_t n = read(fd, buf, BUF_SIZE);
+			if(n > 0) got += n;
+			else if(n == 0) eof = 1;
+			else if(errno != EAGAIN && errno != EINTR) break;
+		}
+		if(want > sent && (p.revents & POLLOUT)) {
+			ssize_t n = write(fd, source, want - sent < BUF_SIZE ? want - sent : BUF_SIZE);
+			if(n > 0) sent += n;
+			else if(errno != EAGAIN && errno != EINTR) break;
+		}
+	}
+	free(buf);
+	*moved = sent + got;
+	return ret;
+}
+
+/* the client sends the record, followed by the speed in thousandths */
+static void replay_target(int fd) {
+	unsigned char rec[TRACE_MAX + 4];
+	struct trace_conn c;
+	unsigned long long moved;
+	size_t len;
+	if(read_full(fd, rec, 2)) return;
+	len = 2 + (rec[0] | rec[1] << 8);
+	if(len > TRACE_MAX || read_full(fd, rec + 2, len - 2 + 4) || trace_decode(rec, len, &c) != len) return;
+	uint32_t speed = rec[len] | rec[len + 1] << 8 | rec[len + 2] << 16 | (uint32_t) rec[len + 3] << 24;
+	pump(fd, &c, TRACE_DOWN, speed / 1000., clock_us(), &moved);
+}
+
+static void* targetconn(void *data) {
+	int fd = (intptr_t) data;
+	char mode;
+	if(read(fd, &mode, 1) == 1) switch(mode) {
+		case MODE_ECHO:
+			write(fd, &mode, 1);
+			break;
+		case MODE_SOURCE:
+			while(write(fd, source, sizeof source) > 0);
+			break;
+		case MODE_REPLAY:
+			replay_target(fd);
+			break;
+	}
+	close(fd);
+	return 0;
+}
+
+static void* targetthread(void *data) {
+	int listenfd = (intptr_t) data;
+	for(;;) {
+		pthread_t pt;
+		int fd = accept(listenfd, 0, 0);
+		if(fd == -1) {
+			msleep(1);
+			continue;
+		}
+		if(start_thread(&pt, targetconn, (void*)(intptr_t) fd)) close(fd);
+		else pthread_detach(pt);
+	}
+	return 0;
+}
+
+static void* holdthread(void *data) {
+	int listenfd = (intptr_t) data;
+	for(;;) {
+		int fd = accept(listenfd, 0, 0);
+		if(fd == -1) {
+			msleep(1);
+			continue;
+		}
+		pthread_mutex_lock(&held_lock);
+		if(!sblist_add(&held, &fd)) close(fd);
+		pthread_mutex_unlock(&held_lock);
+	}
+	return 0;
+}
+
+static int listen_loopback(struct sockaddr_in *sa) {
+	socklen_t len = sizeof *sa;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	*sa = (struct sockaddr_in) {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	if(fd == -1 || bind(fd, (struct sockaddr*) sa, sizeof *sa) ||
+	   listen(fd, SOMAXCONN) || getsockname(fd, (struct sockaddr*) sa, &len)) {
+		perror("target server");
+		exit(1);
+	}
+	return fd;
+}
+
+/* connects to the proxy and sends the greeting, offering password auth
+   if flags (see trace.h) ask for it and we have a password. returns the
+   socket, or -1. */
+static int socks_greet(int flags) {
+	unsigned char greeting[] = {5, 1, 0}, reply[2];
+	struct timeval tv = {.tv_sec = 1};
+	int password = (flags & TRACE_PASSWORD) && auth_user;
+	int fd = socket(proxy->ai_family, SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	if(password) greeting[2] = 2;
+	if(connect(fd, proxy->ai_addr, proxy->ai_addrlen) ||
+	   write_full(fd, greeting, sizeof greeting) ||
+	   read_full(fd, reply, 2) || reply[0] != 5 || reply[1] != greeting[2])
+		goto fail;
+	if(password) {
+		unsigned char req[3 + 255 + 255];
+		size_t ulen = strlen(auth_user), plen = strlen(auth_pass);
+		req[0] = 1;
+		req[1] = ulen;
+		memcpy(req + 2, auth_user, ulen);
+		req[2 + ulen] = plen;
+		memcpy(req + 3 + ulen, auth_pass, plen);
+		if(write_full(fd, req, 3 + ulen + plen) || read_full(fd, reply, 2) || reply[1] != 0)
+			goto fail;
+	}
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+/* connects through the proxy to to, and asks the target server there for
+   mode unless it is 0. flags pick the address type and authentication,
+   a dns name request names the ip. returns the socket, or -1. */
+static int socks_connect(const struct sockaddr_in *to, int flags, char mode, unsigned long long *handshake) {
+	unsigned long long start = clock_us();
+	unsigned char req[4 + 1 + 255 + 2] = {5, 1, 0, 1}, reply[10];
+	size_t len;
+	int fd = socks_greet(flags);
+	if(fd == -1) return -1;
+	if((flags & TRACE_ATYP) == 3) {
+		req[3] = 3;
+		inet_ntop(AF_INET, &to->sin_addr, (char*) req + 5, INET_ADDRSTRLEN);
+		req[4] = strlen((char*) req + 5);
+		len = 5 + req[4];
+	} else {
+		memcpy(req + 4, &to->sin_addr, 4);
+		len = 8;
+	}
+	memcpy(req + len, &to->sin_port, 2);
+	len += 2;
+	if(write_full(fd, req, len) || read_full(fd, reply, sizeof reply) || reply[1] != 0)
+		goto fail;
+	*handshake = clock_us() - start;
+	if(mode && write(fd, &mode, 1) != 1) goto fail;
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+static void add_latency(struct worker *w, unsigned long long us) {
+	uint32_t v = us > UINT32_MAX ? UINT32_MAX : us;
+	sblist_add(&w->lat, &v);
+}
+
+static void* shortthread(void *data) {
+	struct worker *w = data;
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		unsigned long long hs;
+		char c;
+		int fd = socks_connect(&target, 1, MODE_ECHO, &hs);
+		if(fd == -1) {
+			w->errors++;
+			/* don't spin when the proxy refuses us */
+			msleep(1);
+			continue;
+		}
+		/* the byte, then eof: the target closes first, so the
+		   TIME_WAIT sockets don't eat up our ephemeral ports */
+		if(read(fd, &c, 1) != 1 || read(fd, &c, 1) != 0) w->errors++;
+		else {
+			w->ops++;
+			add_latency(w, hs);
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+static void* streamthread(void *data) {
+	struct worker *w = data;
+	unsigned long long hs;
+	char *buf = malloc(BUF_SIZE);
+	int fd = socks_connect(&target, 1, MODE_SOURCE, &hs);
+	if(fd == -1 || !buf) {
+		w->errors++;
+		goto out;
+	}
+	w->ops++;
+	add_latency(w, hs);
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		ssize_t n = read(fd, buf, BUF_SIZE);
+		if(n > 0) w->bytes += n;
+		else if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+		else {
+			w->errors++;
+			break;
+		}
+	}
+out:
+	if(fd != -1) close(fd);
+	free(buf);
+	return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
+
+static unsigned long long quantile(sblist *l, double q) {
+	size_t n = sblist_getsize(l);
+	if(!n) return 0;
+	size_t i = q * n;
+	return *(uint32_t*) sblist_get(l, i < n ? i : n - 1);
+}
+
+/* prints the result line of a scenario, extra goes at its end. */
+static void report(const char *name, int clients, double secs, unsigned long long ops,
+                   unsigned long long errors, unsigned long long bytes, sblist *lat, const char *extra) {
+	qsort(lat->items, sblist_getsize(lat), lat->itemsize, cmp_u32);
+	printf("{\"scenario\":\"%s\",\"clients\":%d,\"seconds\":%.3f,"
+		"\"connections\":%llu,\"errors\":%llu,\"connections_per_second\":%.1f,"
+		"\"bytes\":%llu,\"bytes_per_second\":%.0f,"
+		"\"handshake_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}%s}\n",
+		name, clients, secs, ops, errors, ops / secs, bytes, bytes / secs,
+		quantile(lat, .5), quantile(lat, .9), quantile(lat, .99), quantile(lat, 1), extra);
+	fflush(stdout);
+}
+
+/* the cpu time process pid used so far, in seconds, or -1 */
+static double proc_cpu(pid_t pid) {
+	char path[64], line[1024], *p;
+	unsigned long long utime, stime;
+	FILE *f;
+	snprintf(path, sizeof path, "/proc/%d/stat", (int) pid);
+	if(pid <= 0 || !(f = fopen(path, "r"))) return -1;
+	p = fgets(line, sizeof line, f);
+	fclose(f);
+	/* skip the command, which may contain anything */
+	if(!p || !(p = strrchr(line, ')')) ||
+	   sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+		return -1;
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void run(const char *name, void *(*fn)(void*), int clients, pid_t pid) {
+	struct worker *w = calloc(clients, sizeof *w);
+	sblist lat;
+	unsigned long long ops = 0, errors = 0, bytes = 0;
+	int i, n;
+	char extra[128] = "";
+	double cpu = proc_cpu(pid);
+	if(!w) {
+		perror("calloc");
+		exit(1);
+	}
+	dprintf(2, "running %s with %d clients for %ds\n", name, clients, duration);
+	atomic_store(&stop, 0);
+	unsigned long long start = clock_us();
+	for(n = 0; n < clients; n++) {
+		sblist_init(&w[n].lat, sizeof(uint32_t), 4096);
+		if(start_thread(&w[n].pt, fn, &w[n])) {
+			dprintf(2, "could only start %d clients\n", n);
+			sblist_free_items(&w[n].lat);
+			break;
+		}
+	}
+	sleep(duration);
+	atomic_store(&stop, 1);
+	double secs = (clock_us() - start) / 1e6;
+	sblist_init(&lat, sizeof(uint32_t), 4096);
+	for(i = 0; i < n; i++) {
+		uint32_t *v;
+		pthread_join(w[i].pt, 0);
+		ops += w[i].ops;
+		errors += w[i].errors;
+		bytes += w[i].bytes;
+		sblist_iter(&w[i].lat, v) sblist_add(&lat, v);
+		sblist_free_items(&w[i].lat);
+	}
+	free(w);
+	if(cpu >= 0 && (cpu = proc_cpu(pid) - cpu) >= 0)
+		snprintf(extra, sizeof extra, ",\"proxy_cpu_seconds\":%.3f,\"proxy_cpu_seconds_per_gb\":%.3f",
+			cpu, bytes ? cpu / (bytes / 1e9) : 0.);
+	report(name, n, secs, ops, errors, bytes, &lat, extra);
+	sblist_free_items(&lat);
+}
+
+static struct {
+	pthread_mutex_t lock;
+	sblist lat;
+	unsigned long long ops, errors, bytes;
+	atomic_int active;
+	double speed;
+} replay = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void* replaythread(void *data) {
+	const struct trace_conn *c = data;
+	unsigned long long base = clock_us(), hs = 0, moved = 0;
+	int ok = -1, fd;
+	if(!(c->flags & TRACE_RELAYED)) {
+		/* it failed or gave up during the handshake: just greet */
+		if((fd = socks_greet(c->flags)) != -1) {
+			ok = 0;
+			close(fd);
+		}
+	} else if((fd = socks_connect(&target, c->flags, 0, &hs)) != -1) {
+		unsigned char req[1 + TRACE_MAX + 4];
+		uint32_t speed = replay.speed * 1000;
+		size_t n = 1 + trace_encode(req + 1, c);
+		req[0] = MODE_REPLAY;
+		req[n++] = speed;
+		req[n++] = speed >> 8;
+		req[n++] = speed >> 16;
+		req[n++] = speed >> 24;
+		if(!write_full(fd, req, n)) ok = pump(fd, c, TRACE_UP, replay.speed, base, &moved);
+		close(fd);
+	}
+	pthread_mutex_lock(&replay.lock);
+	if(ok) replay.errors++;
+	else replay.ops++;
+	replay.bytes += moved;
+	if(hs) {
+		uint32_t v = hs > UINT32_MAX ? UINT32_MAX : hs;
+		sblist_add(&replay.lat, &v);
+	}
+	pthread_mutex_unlock(&replay.lock);
+	atomic_fetch_sub(&replay.active, 1);
+	return 0;
+}
+
+static int cmp_arrival(const void *a, const void *b) {
+	const struct trace_conn *x = a, *y = b;
+	return (x->arrival > y->arrival) - (x->arrival < y->arrival);
+}
+
+/* reads the records of the trace at path into out, by arrival. */
+static int load_trace(const char *path, sblist *out) {
+	FILE *f = fopen(path, "r");
+	size_t len = 0, cap = 0, off = TRACE_HEADER, n;
+	unsigned char *buf = 0, *p;
+	uint64_t started;
+	if(!f) return -1;
+	for(;;) {
+		if(len == cap) {
+			if(!(p = realloc(buf, cap = cap ? cap * 2 : 1 << 20))) {
+				fclose(f);
+				free(buf);
+				return -1;
+			}
+			buf = p;
+		}
+		if(!(n = fread(buf + len, 1, cap - len, f))) break;
+		len += n;
+	}
+	fclose(f);
+	if(trace_check_header(buf, len, &started)) {
+		free(buf);
+		errno = EINVAL;
+		return -1;
+	}
+	while(off < len) {
+		struct trace_conn c;
+		if(!(n = trace_decode(buf + off, len - off, &c))) {
+			dprintf(2, "%s: ignoring %zu bytes of broken records at the end\n", path, len - off);
+			break;
+		}
+		if(!sblist_add(out, &c)) break;
+		off += n;
+	}
+	free(buf);
+	qsort(out->items, sblist_getsize(out), out->itemsize, cmp_arrival);
+	return 0;
+}
+
+static void run_replay(sblist *recs, double speed) {
+	size_t i, n = sblist_getsize(recs);
+	char extra[64];
+	dprintf(2, "replaying %zu connections at %gx\n", n, speed);
+	replay.speed = speed;
+	sblist_init(&replay.lat, sizeof(uint32_t), 4096);
+	unsigned long long start = clock_us();
+	uint64_t first = n ? ((struct trace_conn*) sblist_get(recs, 0))->arrival : 0, last = first;
+	for(i = 0; i < n; i++) {
+		struct trace_conn *c = sblist_get(recs, i);
+		unsigned long long at = start + (c->arrival - first) / speed, now = clock_us();
+		pthread_t pt;
+		if(at > now) {
+			struct timespec ts = {.tv_sec = (at - now) / 1000000, .tv_nsec = (at - now) % 1000000 * 1000};
+			nanosleep(&ts, 0);
+		}
+		if(c->arrival + c->lifetime > last) last = c->arrival + c->lifetime;
+		atomic_fetch_add(&replay.active, 1);
+		if(start_thread(&pt, replaythread, c)) {
+			atomic_fetch_sub(&replay.active, 1);
+			pthread_mutex_lock(&replay.lock);
+			replay.errors++;
+			pthread_mutex_unlock(&replay.lock);
+		} else pthread_detach(pt);
+	}
+	while(atomic_load(&replay.active)) msleep(10);
+	snprintf(extra, sizeof extra, ",\"speed\":%g,\"trace_seconds\":%.3f", speed, (last - first) / 1e6);
+	report("replay", n, (clock_us() - start) / 1e6, replay.ops, replay.errors, replay.bytes, &replay.lat, extra);
+	sblist_free_items(&replay.lat);
+}
+
+/* the rss in bytes and the thread count of process pid */
+static int proc_status(pid_t pid, long long *rss, long long *threads) {
+	char path[64], line[256];
+	FILE *f;
+	snprintf(path, sizeof path, "/proc/%d/status", (int) pid);
+	if(!(f = fopen(path, "r"))) return -1;
+	*rss = *threads = -1;
+	while(fgets(line, sizeof line, f)) {
+		if(sscanf(line, "VmRSS: %lld", rss) == 1) *rss *= 1024;
+		else sscanf(line, "Threads: %lld", threads);
+	}
+	fclose(f);
+	return *rss < 0 || *threads < 0 ? -1 : 0;
+}
+
+/* the memory all tcp sockets of the system use, in bytes, or -1 */
+static long long tcp_mem(void) {
+	char line[256];
+	long long pages = -1;
+	FILE *f = fopen("/proc/net/sockstat", "r");
+	if(!f) return -1;
+	while(fgets(line, sizeof line, f))
+		if(sscanf(line, "TCP: inuse %*d orphan %*d tw %*d alloc %*d mem %lld", &pages) == 1) break;
+	fclose(f);
+	return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+/* tcp_mem() once the sockets of earlier scenarios stopped giving their
+   memory back, or after a few seconds. */
+static long long tcp_mem_settled(void) {
+	long long mem = tcp_mem(), prev;
+	int i;
+	for(i = 0; i < 30 && mem >= 0; i++) {
+		msleep(100);
+		prev = mem;
+		if((mem = tcp_mem()) == prev) break;
+	}
+	return mem;
+}
+
+/* what n connections added, memory that went back elsewhere meanwhile
+   doesn't pay for them. */
+static long long growth(long long before, long long after) {
+	return after > before ? after - before : 0;
+}
+
+static void print_per_conn(const char *name, int ok, long long before, long long after, int n) {
+	if(ok) printf(",\"%s\":%lld,\"%s_per_connection\":%.1f", name, after - before, name,
+		n ? (double) (after - before) / n : 0.);
+	else printf(",\"%s\":null,\"%s_per_connection\":null", name, name);
+}
+
+/* opens n idle sessions and measures what they cost. returns 1 when that
+   is more than budget bytes per connection. */
+static int run_idle(int n, pid_t pid, long long budget) {
+	int *fds = malloc(n * sizeof *fds), open = 0, i, over = 0;
+	long long rss[2], threads[2], mem[2];
+	unsigned long long errors = 0;
+	if(!fds) {
+		perror("malloc");
+		exit(1);
+	}
+	dprintf(2, "running idle with %d connections\n", n);
+	mem[0] = tcp_mem_settled();
+	int have_proc = pid > 0 && !proc_status(pid, &rss[0], &threads[0]);
+	for(i = 0; i < n; i++) {
+		unsigned long long hs;
+		int fd = socks_connect(&hold, 1, 0, &hs);
+		if(fd == -1) errors++;
+		else fds[open++] = fd;
+	}
+	/* give the last connections time to reach the relay loop */
+	sleep(1);
+	have_proc = have_proc && !proc_status(pid, &rss[1], &threads[1]);
+	mem[1] = tcp_mem();
+	int have_mem = mem[0] >= 0 && mem[1] >= 0;
+
+	for(i = 0; i < open; i++) close(fds[i]);
+	free(fds);
+	pthread_mutex_lock(&held_lock);
+	int *fd;
+	sblist_iter(&held, fd) close(*fd);
+	held.count = 0;
+	pthread_mutex_unlock(&held_lock);
+
+	if(budget && open) {
+		long long used = (have_proc ? growth(rss[0], rss[1]) : 0) + (have_mem ? growth(mem[0], mem[1]) : 0);
+		over = used > budget * open;
+	}
+	printf("{\"scenario\":\"idle\",\"connections\":%d,\"errors\":%llu", open, errors);
+	print_per_conn("rss_bytes", have_proc, rss[0], rss[1], open);
+	print_per_conn("threads", have_proc, threads[0], threads[1], open);
+	print_per_conn("socket_mem_bytes", have_mem, mem[0], mem[1], open);
+	printf(",\"budget_per_connection\":%lld,\"over_budget\":%s}\n", budget, over ? "true" : "false");
+	fflush(stdout);
+	return over;
+}
+
+/* starts prog listening on a free loopback port, with the extra options. */
+static pid_t spawn_proxy(char *prog, char **extra, int nextra, char *port) {
+	struct sockaddr_in sa;
+	int fd = listen_loopback(&sa), i;
+	char **argv = calloc(nextra + 7, sizeof *argv);
+	/* the port is free again once we close this; racy, but good enough
+	   for a benchmark on an otherwise idle machine */
+	snprintf(port, 6, "%u", ntohs(sa.sin_port));
+	close(fd);
+	argv[0] = prog;
+	argv[1] = "-q";
+	argv[2] = "-i";
+	argv[3] = "127.0.0.1";
+	argv[4] = "-p";
+	argv[5] = port;
+	for(i = 0; i < nextra; i++) argv[6 + i] = extra[i];
+	pid_t pid = fork();
+	if(pid == 0) {
+		execv(prog, argv);
+		perror(prog);
+		_exit(127);
+	}
+	free(argv);
+	return pid;
+}
+
+static int wait_proxy(void) {
+	int tries;
+	for(tries = 0; tries < 500; tries++) {
+		int fd = socket(proxy->ai_family, SOCK_STREAM, 0);
+		int ok = fd != -1 && !connect(fd, proxy->ai_addr, proxy->ai_addrlen);
+		if(fd != -1) close(fd);
+		if(ok) return 0;
+		msleep(10);
+	}
+	return -1;
+}
+
+static int usage(void) {
+	dprintf(2,
+		"usage: microsocks-bench [-x proxy | -s host:port [-p pid]] [-t scenarios] [-d seconds]\n"
+		"                        [-c clients] [-n clients] [-m streams] [-k idle] [-B budget]\n"
+		"                        [-r trace [-R speed]] [-u user:pass] [-- proxy options]\n"
+		"benchmarks a socks5 proxy against a target server of its own on loopback.\n"
+		"option -x starts the proxy binary on a free loopback port with the options\n"
+		" after --, option -s uses a running proxy at host:port instead, whose pid\n"
+		" -p gives.\n"
+		"option -t is a comma-separated list of scenarios (default: all of them):\n"
+		" cps: short connections per second with -c clients (default 8)\n"
+		" handshake: handshake latency with -n concurrent clients (default 100)\n"
+		" stream: throughput of a single download\n"
+		" streams: aggregate throughput of -m concurrent downloads (default 64)\n"
+		" idle: memory used by -k idle connections (default 1000)\n"
+		" replay: the connections recorded by microsocks -x in the file -r names, at\n"
+		"  -R times the original speed (default 1). the default scenario with -r.\n"
+		"  connections that used a password use user:pass from -u, if given.\n"
+		"option -B fails the idle scenario, and the exit status, when the proxy's rss\n"
+		" and the kernel's socket memory grew by more than budget bytes per connection.\n"
+		"option -d sets how long each scenario runs (default 5 seconds).\n"
+		"with the proxy's pid (-x or -p), results include the cpu time it used.\n"
+		"results are printed as one json line per scenario.\n");
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	int ch, cps_clients = 8, hs_clients = 100, streams = 64, idle = 1000;
+	long long budget = 0;
+	char *prog = 0, *host = "127.0.0.1", port[6] = "1080", *p;
+	char scenarios[256] = "cps,handshake,stream,streams,idle";
+	const char *trace = 0;
+	double speed = 1;
+	int have_scenarios = 0;
+	pid_t pid = 0;
+	while((ch = getopt(argc, argv, "x:s:p:t:d:c:n:m:k:B:r:R:u:")) != -1) {
+		switch(ch) {
+			case 'x':
+				prog = optarg;
+				break;
+			case 's':
+				host = optarg;
+				if(!(p = strrchr(optarg, ':'))) return usage();
+				*p = 0;
+				snprintf(port, sizeof port, "%s", p + 1);
+				break;
+			case 'p':
+				pid = atoi(optarg);
+				break;
+			case 't':
+				snprintf(scenarios, sizeof scenarios, "%s", optarg);
+				have_scenarios = 1;
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'c':
+				cps_clients = atoi(optarg);
+				break;
+			case 'n':
+				hs_clients = atoi(optarg);
+				break;
+			case 'm':
+				streams = atoi(optarg);
+				break;
+			case 'k':
+				idle = atoi(optarg);
+				break;
+			case 'B':
+				budget = strtoll(optarg, 0, 10);
+				break;
+			case 'r':
+				trace = optarg;
+				break;
+			case 'R':
+				speed = strtod(optarg, 0);
+				break;
+			case 'u':
+				auth_user = optarg;
+				if(!(p = strchr(optarg, ':')) || strlen(optarg) > 255 + 1 + 255) return usage();
+				*p = 0;
+				auth_pass = p + 1;
+				break;
+			default:
+				return usage();
+		}
+	}
+	if(duration < 1 || cps_clients < 1 || hs_clients < 1 || streams < 1 || idle < 1 || !(speed > 0)) return usage();
+	if(trace && !have_scenarios) strcpy(scenarios, "replay");
+	sblist recs;
+	sblist_init(&recs, sizeof(struct trace_conn), 1024);
+	if(trace && load_trace(trace, &recs)) {
+		perror(trace);
+		return 1;
+	}
+	if(prog ? pid != 0 : optind != argc) return usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	/* every client costs a descriptor here and two in the proxy */
+	struct rlimit rl;
+	if(!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	memset(source, 'x', sizeof source);
+	pthread_t pt;
+	int listenfd = listen_loopback(&target), holdfd = listen_loopback(&hold);
+	sblist_init(&held, sizeof(int), 1024);
+	if(start_thread(&pt, targetthread, (void*)(intptr_t) listenfd) ||
+	   start_thread(&pt, holdthread, (void*)(intptr_t) holdfd)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	if(prog) pid = spawn_proxy(prog, argv + optind, argc - optind, port);
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	int err = getaddrinfo(host, port, &hints, &proxy);
+	if(err) {
+		dprintf(2, "%s: %s\n", host, gai_strerror(err));
+		goto out;
+	}
+	if(wait_proxy()) {
+		dprintf(2, "proxy at %s:%s doesn't accept connections\n", host, port);
+		err = 1;
+		goto out;
+	}
+
+	char *save, *s;
+	for(s = strtok_r(scenarios, ",", &save); s; s = strtok_r(0, ",", &save)) {
+		if(!strcmp(s, "cps")) run(s, shortthread, cps_clients, pid);
+		else if(!strcmp(s, "handshake")) run(s, shortthread, hs_clients, pid);
+		else if(!strcmp(s, "stream")) run(s, streamthread, 1, pid);
+		else if(!strcmp(s, "streams")) run(s, streamthread, streams, pid);
+		else if(!strcmp(s, "idle")) err |= run_idle(idle, pid, budget);
+		else if(!strcmp(s, "replay") && trace) run_replay(&recs, speed);
+		else {
+			dprintf(2, "unknown scenario %s\n", s);
+			err = 1;
+			break;
+		}
+	}
+out:
+	if(prog && pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, 0, 0);
+	}
+	return !!err;
+}
@@ -0,0 +1,59 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "budget.h"
+
+const char *budget_kind_names[BUDGET_KINDS] = {
+	[BUDGET_RELAY] = "relay",
+	[BUDGET_SOCKET] = "socket",
+};
+
+atomic_uint budget_mb;
+static atomic_ullong used[BUDGET_KINDS];
+
+static unsigned long long limit(void) {
+	return atomic_load_explicit(&budget_mb, memory_order_relaxed) * 1024ULL * 1024;
+}
+
+static unsigned long long total(void) {
+	unsigned long long sum = 0;
+	size_t i;
+	for(i = 0; i < BUDGET_KINDS; i++)
+		sum += atomic_load_explicit(&used[i], memory_order_relaxed);
+	return sum;
+}
+
+int budget_charge(enum budget_kind kind, size_t n, int force) {
+	atomic_fetch_add_explicit(&used[kind], n, memory_order_relaxed);
+	unsigned long long max = limit();
+	if(force || !max || total() <= max) return 0;
+	atomic_fetch_sub_explicit(&used[kind], n, memory_order_relaxed);
+	return -1;
+}
+
+void budget_release(enum budget_kind kind, size_t n) {
+	atomic_fetch_sub_explicit(&used[kind], n, memory_order_relaxed);
+}
+
+unsigned long long budget_used(enum budget_kind kind) {
+	return atomic_load_explicit(&used[kind], memory_order_relaxed);
+}
+
+enum budget_level budget_level(void) {
+	unsigned long long max = limit(), sum;
+	if(!max) return BUDGET_OK;
+	sum = total();
+	if(sum * 100 >= max * BUDGET_FULL_PCT) return BUDGET_EXHAUSTED;
+	if(sum * 100 >= max * BUDGET_TIGHT_PCT) return BUDGET_TIGHT;
+	return BUDGET_OK;
+}
+
+int budget_sockbuf(int want) {
+	unsigned long long max = limit(), sum, left;
+	if(!max) return want;
+	sum = total();
+	left = sum < max ? max - sum : 0;
+	/* both the send and the receive buffer */
+	while(want > BUDGET_SOCKBUF_MIN && 2ULL * want * BUDGET_SOCKBUF_SHARE > left)
+		want /= 2;
+	return want;
+}
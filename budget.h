@@ -0,0 +1,54 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#pragma RcB2 DEP "budget.c"
+
+/* a global memory budget (-B) for what connections make the process and
+   the kernel hold: relay buffers, and the socket buffers requested for
+   every connection. a socket buffer only costs memory while data queues
+   up in it, but that is exactly what piles up behind slow receivers, so
+   the requested size is charged in full.
+
+   nothing that would break a connection is refused: a socket still gets
+   buffers when memory is short, just smaller ones, and a read without a
+   relay buffer falls back to a small one on the stack. as the budget
+   fills up the level rises, and the relay path backs off. */
+
+enum budget_kind {
+	BUDGET_RELAY,
+	BUDGET_SOCKET,
+	BUDGET_KINDS
+};
+extern const char *budget_kind_names[BUDGET_KINDS];
+
+enum budget_level {
+	BUDGET_OK,
+	BUDGET_TIGHT,     /* BUDGET_TIGHT_PCT of the limit used */
+	BUDGET_EXHAUSTED, /* BUDGET_FULL_PCT of the limit used */
+};
+#define BUDGET_TIGHT_PCT 75
+#define BUDGET_FULL_PCT 95
+
+/* a new socket's buffers are shrunk until they take no more than a
+   BUDGET_SOCKBUF_SHARE'th of what is left, but not below
+   BUDGET_SOCKBUF_MIN. */
+#define BUDGET_SOCKBUF_SHARE 32
+#define BUDGET_SOCKBUF_MIN (64*1024)
+
+/* the limit in megabytes, 0 for none. may be changed at any time. */
+extern atomic_uint budget_mb;
+
+/* charges n bytes. unless force is set, that fails with -1 if it would
+   overrun the limit. */
+int budget_charge(enum budget_kind kind, size_t n, int force);
+void budget_release(enum budget_kind kind, size_t n);
+unsigned long long budget_used(enum budget_kind kind);
+enum budget_level budget_level(void);
+/* the size of the send and of the receive buffer a new socket gets,
+   when it would get want bytes each without a budget. */
+int budget_sockbuf(int want);
+
+#endif
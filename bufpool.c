@@ -0,0 +1,108 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "bufpool.h"
+#include "budget.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* a free buffer's first bytes link it to the next one. interactive
+   connections give their buffer back before every poll and take one
+   after it, so one lock per class would see every relay thread. each
+   class has SHARDS free lists instead, and threads take turns at which
+   one is theirs, like the log rings. a thread whose own list is empty
+   looks at the others before it mallocs, skipping the ones that are
+   busy. the cache can't live in the threads themselves: a connection
+   that waits must not hold on to a buffer. */
+#define SHARDS 8
+
+struct freebuf {
+	struct freebuf *next;
+};
+
+struct shard {
+	/* on a cache line of its own, so threads on different shards don't
+	   fight over it */
+	_Alignas(64) pthread_mutex_t lock;
+	struct freebuf *free;
+};
+
+static struct pool {
+	struct shard shards[SHARDS];
+	/* buffers on the free lists, counted before they get there */
+	atomic_ullong cached, in_use;
+} pools[BUFPOOL_CLASSES] = {
+#define S {.lock = PTHREAD_MUTEX_INITIALIZER}
+#define P {.shards = {S, S, S, S, S, S, S, S}}
+	P, P, P, P, P, P, P,
+#undef P
+#undef S
+};
+
+/* 1 + the thread's shard, 0 until it needs one */
+static _Thread_local unsigned mine;
+static atomic_uint next_shard;
+
+static unsigned my_shard(void) {
+	if(!mine) mine = 1 + atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % SHARDS;
+	return mine - 1;
+}
+
+static struct freebuf *pop(struct shard *s) {
+	struct freebuf *b = s->free;
+	if(b) s->free = b->next;
+	return b;
+}
+
+void *bufpool_get(unsigned cls) {
+	struct pool *p = &pools[cls];
+	unsigned i, own = my_shard();
+	struct freebuf *b;
+	pthread_mutex_lock(&p->shards[own].lock);
+	b = pop(&p->shards[own]);
+	pthread_mutex_unlock(&p->shards[own].lock);
+	for(i = 1; !b && i < SHARDS && atomic_load_explicit(&p->cached, memory_order_relaxed); i++) {
+		struct shard *s = &p->shards[(own + i) % SHARDS];
+		if(pthread_mutex_trylock(&s->lock)) continue;
+		b = pop(s);
+		pthread_mutex_unlock(&s->lock);
+	}
+	if(b) atomic_fetch_sub_explicit(&p->cached, 1, memory_order_relaxed);
+	else {
+		/* cached buffers are charged already */
+		if(budget_charge(BUDGET_RELAY, bufpool_size(cls), 0)) return 0;
+		if(!(b = malloc(bufpool_size(cls)))) {
+			budget_release(BUDGET_RELAY, bufpool_size(cls));
+			return 0;
+		}
+	}
+	atomic_fetch_add_explicit(&p->in_use, 1, memory_order_relaxed);
+	return b;
+}
+
+void bufpool_put(void *buf, unsigned cls) {
+	struct pool *p = &pools[cls];
+	struct freebuf *b = buf;
+	struct shard *s = &p->shards[my_shard()];
+	atomic_fetch_sub_explicit(&p->in_use, 1, memory_order_relaxed);
+	/* when memory is short, cached buffers are better off as socket
+	   buffers or other connections' relay buffers */
+	if(budget_level() == BUDGET_OK) {
+		if(atomic_fetch_add_explicit(&p->cached, 1, memory_order_relaxed) < BUFPOOL_CACHE / bufpool_size(cls)) {
+			pthread_mutex_lock(&s->lock);
+			b->next = s->free;
+			s->free = b;
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+		atomic_fetch_sub_explicit(&p->cached, 1, memory_order_relaxed);
+	}
+	free(b);
+	budget_release(BUDGET_RELAY, bufpool_size(cls));
+}
+
+void bufpool_stats(unsigned cls, struct bufpool_stats *out) {
+	struct pool *p = &pools[cls];
+	out->in_use = atomic_load_explicit(&p->in_use, memory_order_relaxed);
+	out->cached = atomic_load_explicit(&p->cached, memory_order_relaxed);
+}
@@ -0,0 +1,36 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+#pragma RcB2 DEP "bufpool.c"
+
+/* relay buffers, shared by all connections. sizes come in classes from
+   4 KB doubling up to 256 KB. returned buffers go onto the free lists
+   of their class, which keep up to BUFPOOL_CACHE bytes for reuse and
+   hand the rest back to malloc, so a burst of bulk transfers doesn't
+   pin memory forever. buffers count against the memory budget (see budget.h) from
+   malloc to free. */
+
+#define BUFPOOL_MIN_SHIFT 12
+#define BUFPOOL_CLASSES 7
+#ifndef BUFPOOL_CACHE
+#define BUFPOOL_CACHE (4*1024*1024)
+#endif
+
+static inline size_t bufpool_size(unsigned cls) {
+	return (size_t) 1 << (BUFPOOL_MIN_SHIFT + cls);
+}
+
+/* returns a buffer of bufpool_size(cls) bytes, or 0 if out of memory or
+   budget. */
+void *bufpool_get(unsigned cls);
+void bufpool_put(void *buf, unsigned cls);
+
+struct bufpool_stats {
+	/* buffers handed out and not returned yet, and buffers on the free list */
+	unsigned long long in_use, cached;
+};
+void bufpool_stats(unsigned cls, struct bufpool_stats *out);
+
+#endif
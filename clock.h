@@ -0,0 +1,19 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <time.h>
+
+/* monotonic clock helpers. these never jump with wall clock changes,
+   so they are what all rate limits and timeouts are measured against. */
+
+static inline unsigned long long clock_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline unsigned long long clock_ms(void) {
+	return clock_us() / 1000;
+}
+
+#endif
@@ -0,0 +1,110 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "congestion.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+char congestion_algos[SOCKBUF_KINDS][CONGESTION_NAME];
+
+/* the names congestion_get() came across, linux has only a handful.
+   entries are never changed once counted, so lookups take no lock. */
+#define CONGESTION_IDS 32
+static char names[CONGESTION_IDS][CONGESTION_NAME];
+static atomic_uint name_count = 1;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char name_id(const char *name) {
+	unsigned i, n = atomic_load_explicit(&name_count, memory_order_acquire);
+	for(i = 1; i < n; i++)
+		if(!strcmp(names[i], name)) return i;
+	pthread_mutex_lock(&names_lock);
+	for(n = atomic_load_explicit(&name_count, memory_order_relaxed); i < n; i++)
+		if(!strcmp(names[i], name)) break;
+	if(i == n && n < CONGESTION_IDS) {
+		strcpy(names[n], name);
+		atomic_store_explicit(&name_count, n + 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&names_lock);
+	return i < CONGESTION_IDS ? i : 0;
+}
+
+const char *congestion_name(unsigned char id) {
+	return names[id < CONGESTION_IDS ? id : 0];
+}
+
+static int algo(int kind, const char *s, void *arg) {
+	size_t i;
+	(void) arg;
+	if(strlen(s) >= CONGESTION_NAME) return -1;
+	for(i = 0; i < SOCKBUF_KINDS; i++)
+		if(kind == -1 || kind == (int) i) strcpy(congestion_algos[i], s);
+	return 0;
+}
+
+int congestion_parse(const char *spec) {
+	return sockbuf_each(spec, algo, 0);
+}
+
+#ifdef TCP_CONGESTION
+
+static int set(int fd, const char *name) {
+	return setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, strlen(name));
+}
+
+void congestion_check(void) {
+	size_t i;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	for(i = 0; i < SOCKBUF_KINDS; i++) {
+		if(!congestion_algos[i][0]) continue;
+		/* ENOENT if the module isn't loaded and we may not load it,
+		   EPERM if it isn't in tcp_allowed_congestion_control */
+		if(fd != -1 && !set(fd, congestion_algos[i])) continue;
+		dprintf(2, "warning: congestion control %s for %s sockets: %s, using the system default\n",
+			congestion_algos[i], sockbuf_kind_names[i], strerror(errno));
+		congestion_algos[i][0] = 0;
+	}
+	if(fd != -1) close(fd);
+}
+
+void congestion_set(int fd, enum sockbuf_kind kind) {
+	if(congestion_algos[kind][0]) set(fd, congestion_algos[kind]);
+}
+
+unsigned char congestion_get(int fd) {
+	char name[CONGESTION_NAME];
+	socklen_t len = CONGESTION_NAME - 1;
+	if(getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, &len) || !len) return 0;
+	name[len] = 0;
+	return name_id(name);
+}
+
+#else
+
+void congestion_check(void) {
+	size_t i;
+	for(i = 0; i < SOCKBUF_KINDS; i++) {
+		if(!congestion_algos[i][0]) continue;
+		dprintf(2, "warning: congestion control %s for %s sockets: not supported here, using the system default\n",
+			congestion_algos[i], sockbuf_kind_names[i]);
+		congestion_algos[i][0] = 0;
+	}
+}
+
+void congestion_set(int fd, enum sockbuf_kind kind) {
+	(void) fd; (void) kind;
+}
+
+unsigned char congestion_get(int fd) {
+	(void) fd;
+	(void) name_id;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stddef.h>
+#include "sockbuf.h"
+
+#pragma RcB2 DEP "congestion.c"
+
+/* the tcp congestion control algorithm (TCP_CONGESTION, linux only) for
+   each kind of socket (see sockbuf.h), set with -g. accepted sockets get
+   it from their listener. kinds without one use the system default. */
+
+/* TCP_CA_NAME_MAX */
+#define CONGESTION_NAME 16
+
+extern char congestion_algos[SOCKBUF_KINDS][CONGESTION_NAME];
+
+/* parses a comma-separated list of [kind=]algorithm. returns 0 on
+   success. */
+int congestion_parse(const char *spec);
+/* tries every configured algorithm on a scratch socket, and falls back
+   to the system default, with a warning on stderr, for those that aren't
+   available or allowed. */
+void congestion_check(void);
+/* sets the algorithm for kind on fd, if there is one. */
+void congestion_set(int fd, enum sockbuf_kind kind);
+/* the algorithm fd uses, as a small id for congestion_name(), 0 if
+   unknown. */
+unsigned char congestion_get(int fd);
+/* the name for an id from congestion_get(), an empty string for 0. */
+const char *congestion_name(unsigned char id);
+
+#endif
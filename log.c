@@ -0,0 +1,201 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* each ring is a bounded multi-producer single-consumer queue after
+   Dmitry Vyukov: a slot's seq tells whose turn it is. it equals the
+   position for a free slot, position+1 once the record is published,
+   and the consumer hands it back by setting it to position+LOG_SLOTS. */
+struct log_slot {
+	atomic_uint seq;
+	int chan;
+	log_fn fn;
+	_Alignas(max_align_t) unsigned char data[LOG_PAYLOAD];
+};
+
+struct log_ring {
+	_Alignas(64) atomic_uint head;
+	/* only touched by the log thread */
+	_Alignas(64) unsigned tail;
+	struct log_slot slots[LOG_SLOTS];
+};
+
+/* size of the buffer records are rendered into before writing. */
+#define LOG_BATCH 16384
+
+static struct log_ring rings[LOG_RINGS];
+static _Thread_local struct log_ring *mine;
+static atomic_uint next_ring;
+static atomic_ullong dropped;
+static int log_fds[LOG_CHANNELS] = {2}, nchannels = 1, running;
+/* set while the log thread is about to sleep on wakefds. */
+static atomic_int sleeping;
+static int wakefds[2];
+
+static void write_all(int fd, const char *p, size_t n) {
+	while(n) {
+		ssize_t r = write(fd, p, n);
+		if(r == -1) {
+			if(errno == EINTR) continue;
+			return;
+		}
+		p += r;
+		n -= r;
+	}
+}
+
+static int pending(void) {
+	size_t i;
+	for(i = 0; i < LOG_RINGS; i++) {
+		struct log_ring *r = &rings[i];
+		struct log_slot *s = &r->slots[r->tail & (LOG_SLOTS - 1)];
+		if(atomic_load_explicit(&s->seq, memory_order_acquire) == r->tail + 1)
+			return 1;
+	}
+	return 0;
+}
+
+/* render one record at buf[*len], flushing to fd first if it doesn't fit.
+   records longer than the whole buffer are truncated. */
+static void render(int fd, char *buf, size_t *len, log_fn fn, const void *data) {
+	size_t n = fn(buf + *len, LOG_BATCH - *len, data);
+	if(n >= LOG_BATCH - *len && *len) {
+		write_all(fd, buf, *len);
+		*len = 0;
+		n = fn(buf, LOG_BATCH, data);
+	}
+	if(n >= LOG_BATCH - *len) n = LOG_BATCH - *len - 1;
+	*len += n;
+}
+
+static size_t text(char *out, size_t size, const void *data) {
+	return snprintf(out, size, "%s", (const char*) data);
+}
+
+static size_t drops(char *out, size_t size, const void *data) {
+	return snprintf(out, size, "log: dropped %llu records\n", *(const unsigned long long*) data);
+}
+
+static void* logthread(void *data) {
+	static char buf[LOG_CHANNELS][LOG_BATCH];
+	unsigned long long reported = 0;
+	(void) data;
+	for(;;) {
+		size_t i, len[LOG_CHANNELS] = {0}, n = 0;
+		for(i = 0; i < LOG_RINGS; i++) {
+			struct log_ring *r = &rings[i];
+			for(;;) {
+				struct log_slot *s = &r->slots[r->tail & (LOG_SLOTS - 1)];
+				if(atomic_load_explicit(&s->seq, memory_order_acquire) != r->tail + 1)
+					break;
+				render(log_fds[s->chan], buf[s->chan], &len[s->chan], s->fn, s->data);
+				atomic_store_explicit(&s->seq, r->tail + LOG_SLOTS, memory_order_release);
+				r->tail++;
+				n++;
+			}
+		}
+		unsigned long long d = atomic_load_explicit(&dropped, memory_order_relaxed);
+		if(d != reported) {
+			unsigned long long lost = d - reported;
+			render(log_fds[0], buf[0], &len[0], drops, &lost);
+			reported = d;
+		}
+		for(i = 0; i < LOG_CHANNELS; i++)
+			if(len[i]) write_all(log_fds[i], buf[i], len[i]);
+		if(n) continue;
+		/* same handshake as the accept pause in sockssrv.c: either we see
+		   the new record, or the producer sees us sleeping and wakes us. */
+		atomic_store(&sleeping, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if(!pending()) {
+			struct pollfd p = {.fd = wakefds[0], .events = POLLIN};
+			char c[64];
+			if(poll(&p, 1, 1000) == 1) while(read(wakefds[0], c, sizeof c) > 0);
+		}
+		atomic_store(&sleeping, 0);
+	}
+	return 0;
+}
+
+int log_open(int fd) {
+	if(nchannels == LOG_CHANNELS) return -1;
+	log_fds[nchannels] = fd;
+	return nchannels++;
+}
+
+int log_setup(void) {
+	size_t i, j;
+	pthread_t pt;
+	for(i = 0; i < LOG_RINGS; i++)
+		for(j = 0; j < LOG_SLOTS; j++)
+			atomic_init(&rings[i].slots[j].seq, j);
+	if(pipe(wakefds)) return -1;
+	fcntl(wakefds[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakefds[1], F_SETFL, O_NONBLOCK);
+	if(pthread_create(&pt, 0, logthread, 0)) return -1;
+	pthread_detach(pt);
+	running = 1;
+	return 0;
+}
+
+int log_write(int chan, log_fn fn, const void *data, size_t len) {
+	if(len > LOG_PAYLOAD) {
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return -1;
+	}
+	if(!running) {
+		char buf[1024];
+		size_t n = fn(buf, sizeof buf, data);
+		write_all(log_fds[chan], buf, n < sizeof buf ? n : sizeof buf - 1);
+		return 0;
+	}
+	if(!mine) mine = &rings[atomic_fetch_add_explicit(&next_ring, 1, memory_order_relaxed) % LOG_RINGS];
+	struct log_ring *r = mine;
+	struct log_slot *s;
+	unsigned pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	for(;;) {
+		s = &r->slots[pos & (LOG_SLOTS - 1)];
+		int dif = (int) (atomic_load_explicit(&s->seq, memory_order_acquire) - pos);
+		if(dif == 0) {
+			if(atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+			   memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if(dif < 0) {
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return -1;
+		} else
+			pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	}
+	s->chan = chan;
+	s->fn = fn;
+	memcpy(s->data, data, len);
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&sleeping, memory_order_relaxed) && atomic_exchange(&sleeping, 0))
+		write(wakefds[1], "", 1);
+	return 0;
+}
+
+int log_printf(const char *fmt, ...) {
+	char buf[LOG_PAYLOAD];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	if(n < 0) return -1;
+	if((size_t) n >= sizeof buf) n = sizeof buf - 1;
+	return log_write(0, text, buf, n + 1);
+}
+
+unsigned long long log_dropped(void) {
+	return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
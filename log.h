@@ -0,0 +1,46 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+#pragma RcB2 DEP "log.c"
+
+/* asynchronous logging: producers copy a small binary record into one of
+   LOG_RINGS bounded lock-free rings and return, a background thread turns
+   the records into text and writes them out in batches. formatting, and
+   the write() that may block on a slow pipe, thus never happen on the
+   connection threads. when a ring is full the record is dropped and
+   counted instead.
+   records go to one of LOG_CHANNELS output files, channel 0 is stderr. */
+
+#ifndef LOG_RINGS
+#define LOG_RINGS 16
+#endif
+/* records per ring, must be a power of two. */
+#ifndef LOG_SLOTS
+#define LOG_SLOTS 64
+#endif
+/* maximum size of a record's payload. */
+#define LOG_PAYLOAD 384
+#define LOG_CHANNELS 4
+
+/* called by the log thread to render a record into out, which has room
+   for size bytes. returns the length of the text like snprintf does. */
+typedef size_t (*log_fn)(char *out, size_t size, const void *data);
+
+/* add an output file, returns its channel number or -1 if there are
+   too many. must be called before log_setup(). */
+int log_open(int fd);
+/* start the log thread. returns 0 on success. until then records are
+   written synchronously. */
+int log_setup(void);
+/* queue a record of len bytes (at most LOG_PAYLOAD) for channel chan, to
+   be rendered by fn. returns 0, or -1 if it was dropped. */
+int log_write(int chan, log_fn fn, const void *data, size_t len);
+/* printf-style convenience for rare messages to stderr; the text is
+   formatted right away, only the write is deferred. */
+int log_printf(const char *fmt, ...);
+/* number of records dropped so far. */
+unsigned long long log_dropped(void);
+
+#endif
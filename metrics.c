@@ -0,0 +1,257 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "metrics.h"
+#include "server.h"
+#include "stats.h"
+#include "log.h"
+#include "topk.h"
+#include "bufpool.h"
+#include "slab.h"
+#include "budget.h"
+#include "sockbuf.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+struct outbuf {
+	char *p;
+	size_t len, cap;
+};
+
+static void out(struct outbuf *o, const char *fmt, ...) {
+	va_list ap;
+	for(;;) {
+		size_t avail = o->cap - o->len;
+		va_start(ap, fmt);
+		int n = o->p ? vsnprintf(o->p + o->len, avail, fmt, ap) : -1;
+		va_end(ap);
+		if(n >= 0 && (size_t) n < avail) {
+			o->len += n;
+			return;
+		}
+		size_t cap = o->cap ? o->cap * 2 : 4096;
+		char *p = realloc(o->p, cap);
+		if(!p) return;
+		o->p = p;
+		o->cap = cap;
+	}
+}
+
+static void header(struct outbuf *o, const char *name, const char *type, const char *help) {
+	out(o, "# HELP microsocks_%s %s\n# TYPE microsocks_%s %s\n", name, help, name, type);
+}
+
+/* escapes a label value. host names come from clients and may hold any
+   byte, those that aren't printable ascii are replaced. */
+static char *label(char *out, const char *s) {
+	char *p = out;
+	for(; *s; s++) {
+		unsigned char c = *s;
+		if(c == '"' || c == '\\') *p++ = '\\';
+		*p++ = c >= 0x20 && c < 0x7f ? c : '?';
+	}
+	*p = 0;
+	return out;
+}
+
+static void top(struct outbuf *o, const char *name, const char *kind, enum topk_list l) {
+	struct topk_entry e[TOPK_SIZE];
+	char key[TOPK_KEY + 1], esc[2 * TOPK_KEY + 1];
+	size_t i, n = topk_get(l, e, TOPK_SIZE);
+	for(i = 0; i < n; i++)
+		out(o, "microsocks_%s{%s=\"%s\"} %llu\n", name, kind,
+			label(esc, topk_name(l, &e[i], key, sizeof key)), e[i].count);
+}
+
+static void summary(struct outbuf *o, const char *name, const char *label, const char *value,
+                    const struct stats_quantiles *q, double scale) {
+	static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+	unsigned long long v[] = {q->p50, q->p90, q->p99, q->p999};
+	size_t i;
+	for(i = 0; i < sizeof v / sizeof v[0]; i++)
+		out(o, "microsocks_%s{%s=\"%s\",quantile=\"%s\"} %.6g\n", name, label, value, quantiles[i], v[i] * scale);
+	out(o, "microsocks_%s_sum{%s=\"%s\"} %.6g\n", name, label, value, q->sum * scale);
+	out(o, "microsocks_%s_count{%s=\"%s\"} %llu\n", name, label, value, q->count);
+}
+
+static void render(struct outbuf *o) {
+	struct stats_totals t;
+	size_t i;
+	stats_sum(&t);
+	header(o, "connections", "gauge", "Connections currently open, by state.");
+	for(i = 0; i < STATS_STATES; i++)
+		out(o, "microsocks_connections{state=\"%s\"} %lld\n", stats_state_names[i], (long long) t.states[i]);
+	header(o, "accepts_total", "counter", "Connections accepted.");
+	out(o, "microsocks_accepts_total %llu\n", t.accepts);
+	header(o, "rejects_total", "counter", "Connections closed before reaching a worker thread, by reason.");
+	for(i = 0; i < REJECT_MAX; i++)
+		out(o, "microsocks_rejects_total{reason=\"%s\"} %llu\n", stats_reject_names[i], t.rejects[i]);
+	header(o, "socks_errors_total", "counter", "Failed socks requests, by reply code.");
+	for(i = 1; i < STATS_ERRORS; i++)
+		out(o, "microsocks_socks_errors_total{code=\"%s\"} %llu\n", stats_error_names[i], t.errors[i]);
+	header(o, "bytes_total", "counter", "Bytes relayed, in is from the target to the client.");
+	out(o, "microsocks_bytes_total{direction=\"in\"} %llu\n", t.bytes_in);
+	out(o, "microsocks_bytes_total{direction=\"out\"} %llu\n", t.bytes_out);
+	header(o, "flows", "gauge", "Directions of relayed connections, by flow class.");
+	for(i = 0; i < FLOW_CLASSES; i++)
+		out(o, "microsocks_flows{class=\"%s\"} %lld\n", stats_flow_names[i], (long long) t.flows[i]);
+	header(o, "top_client_connections", "gauge", "Clients with the most connections in the last stats interval (estimated).");
+	top(o, "top_client_connections", "client", TOP_CLIENT_CONNS);
+	header(o, "top_client_bytes", "gauge", "Clients with the most relayed bytes in the last stats interval (estimated).");
+	top(o, "top_client_bytes", "client", TOP_CLIENT_BYTES);
+	header(o, "top_destination_connections", "gauge", "Destinations with the most connections in the last stats interval (estimated).");
+	top(o, "top_destination_connections", "host", TOP_DEST_CONNS);
+	header(o, "top_destination_bytes", "gauge", "Destinations with the most relayed bytes in the last stats interval (estimated).");
+	top(o, "top_destination_bytes", "host", TOP_DEST_BYTES);
+	header(o, "log_dropped_total", "counter", "Log lines dropped because the log thread fell behind.");
+	out(o, "microsocks_log_dropped_total %llu\n", log_dropped());
+	struct bufpool_stats bp[BUFPOOL_CLASSES];
+	for(i = 0; i < BUFPOOL_CLASSES; i++) bufpool_stats(i, &bp[i]);
+	header(o, "relay_buffers", "gauge", "Relay buffers held by connections, by size.");
+	for(i = 0; i < BUFPOOL_CLASSES; i++)
+		out(o, "microsocks_relay_buffers{size=\"%zu\"} %llu\n", bufpool_size(i), bp[i].in_use);
+	header(o, "relay_buffers_cached", "gauge", "Free relay buffers kept for reuse, by size.");
+	for(i = 0; i < BUFPOOL_CLASSES; i++)
+		out(o, "microsocks_relay_buffers_cached{size=\"%zu\"} %llu\n", bufpool_size(i), bp[i].cached);
+	header(o, "memory_budget_bytes", "gauge", "The memory budget (-B), 0 if there is none.");
+	out(o, "microsocks_memory_budget_bytes %llu\n", budget_mb * 1024ULL * 1024);
+	header(o, "memory_budget_used_bytes", "gauge", "Memory charged to the budget, by kind: relay buffers or requested socket buffers.");
+	for(i = 0; i < BUDGET_KINDS; i++)
+		out(o, "microsocks_memory_budget_used_bytes{kind=\"%s\"} %llu\n", budget_kind_names[i], budget_used(i));
+	header(o, "memory_budget_level", "gauge", "0 while memory is plenty, 1 when it is tight, 2 when it is exhausted.");
+	out(o, "microsocks_memory_budget_level %d\n", (int) budget_level());
+	header(o, "socket_buffer_bytes", "gauge", "The most send and receive buffers of a new socket may hold now, by kind of socket.");
+	for(i = 0; i < SOCKBUF_KINDS; i++) {
+		int want = sockbuf_size(i, 0);
+		out(o, "microsocks_socket_buffer_bytes{kind=\"%s\"} %d\n", sockbuf_kind_names[i],
+			budget_sockbuf(want ? want : sockbuf_auto_max()));
+	}
+	header(o, "relay_pauses_total", "counter", "Reads held off because the memory budget was exhausted.");
+	out(o, "microsocks_relay_pauses_total %llu\n", t.relay_pauses);
+	struct slab_cache *c;
+	header(o, "slab_objects", "gauge", "Objects allocated from slabs, by cache.");
+	for(i = 0; (c = slab_cache_get(i)); i++)
+		out(o, "microsocks_slab_objects{cache=\"%s\"} %llu\n", c->name, (unsigned long long) c->objects);
+	header(o, "slab_chunks", "gauge", "Slab chunks, by cache and state: used, kept empty, or released to the kernel.");
+	for(i = 0; (c = slab_cache_get(i)); i++) {
+		unsigned long long empty = c->empty, released = c->released;
+		out(o, "microsocks_slab_chunks{cache=\"%s\",state=\"used\"} %llu\n", c->name, c->slabs - empty - released);
+		out(o, "microsocks_slab_chunks{cache=\"%s\",state=\"empty\"} %llu\n", c->name, empty);
+		out(o, "microsocks_slab_chunks{cache=\"%s\",state=\"released\"} %llu\n", c->name, released);
+	}
+	header(o, "phase_seconds", "summary", "Time spent per connection phase, quantiles cover the last stats interval.");
+	for(i = 0; i < PHASE_MAX; i++) {
+		struct stats_quantiles q;
+		stats_latency(i, &q);
+		summary(o, "phase_seconds", "phase", stats_phase_names[i], &q, 1e-6);
+	}
+	header(o, "fastopen_tries_total", "counter", "Upstream connects that put pipelined client data in their SYN (-f).");
+	out(o, "microsocks_fastopen_tries_total %llu\n", t.fastopen_tries);
+	header(o, "fastopen_syn_data_total", "counter", "Connections whose SYN carried data the peer took, by leg.");
+	for(i = 0; i < LEG_MAX; i++)
+		out(o, "microsocks_fastopen_syn_data_total{leg=\"%s\"} %llu\n", stats_leg_names[i], t.fastopen_syn_data[i]);
+	header(o, "zerocopy_bytes_total", "counter", "Bytes sent with MSG_ZEROCOPY (-Z), by whether the kernel ended up copying them.");
+	out(o, "microsocks_zerocopy_bytes_total{result=\"sent\"} %llu\n", t.zerocopy_sent);
+	out(o, "microsocks_zerocopy_bytes_total{result=\"copied\"} %llu\n", t.zerocopy_copied);
+	header(o, "tcp_retransmits_total", "counter", "Retransmitted segments seen in TCP_INFO samples, by leg.");
+	for(i = 0; i < LEG_MAX; i++)
+		out(o, "microsocks_tcp_retransmits_total{leg=\"%s\"} %llu\n", stats_leg_names[i], t.retransmits[i]);
+	static const struct {
+		const char *name, *help;
+		double scale;
+	} tcp[TCP_MAX] = {
+		[TCP_RTT] = {"tcp_rtt_seconds", "Smoothed round trip time", 1e-6},
+		[TCP_RTTVAR] = {"tcp_rttvar_seconds", "Round trip time variation", 1e-6},
+		[TCP_CWND] = {"tcp_cwnd_segments", "Congestion window", 1},
+		[TCP_DELIVERY_RATE] = {"tcp_delivery_rate_bytes_per_second", "Delivery rate", 1},
+		[TCP_NOTSENT] = {"tcp_notsent_bytes", "Bytes queued but not yet sent", 1},
+	};
+	for(i = 0; i < TCP_MAX; i++) {
+		char help[128];
+		size_t leg;
+		snprintf(help, sizeof help, "%s from TCP_INFO samples of relayed connections, by leg.", tcp[i].help);
+		header(o, tcp[i].name, "summary", help);
+		for(leg = 0; leg < LEG_MAX; leg++) {
+			struct stats_quantiles q;
+			stats_tcp_quantiles(leg, i, &q);
+			summary(o, tcp[i].name, "leg", stats_leg_names[leg], &q, tcp[i].scale);
+		}
+	}
+}
+
+static void write_all(int fd, const char *p, size_t len) {
+	ssize_t r;
+	while(len && (r = write(fd, p, len)) > 0) {
+		p += r;
+		len -= r;
+	}
+}
+
+void metrics_write(int fd) {
+	struct outbuf body = {0};
+	render(&body);
+	if(body.p) write_all(fd, body.p, body.len);
+	free(body.p);
+}
+
+static void serve(int fd) {
+	char req[1024];
+	size_t n = 0;
+	ssize_t r;
+	struct timeval tv = {.tv_sec = 2};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	/* we don't care what is asked for, but wait for the whole request
+	   so closing the socket doesn't reset the connection. */
+	while(n < sizeof req - 1 && (r = read(fd, req + n, sizeof req - 1 - n)) > 0) {
+		n += r;
+		req[n] = 0;
+		if(strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+	}
+	struct outbuf body = {0}, head = {0};
+	render(&body);
+	out(&head, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n\r\n", body.len);
+	if(head.p && body.p) {
+		write_all(fd, head.p, head.len);
+		write_all(fd, body.p, body.len);
+	}
+	free(head.p);
+	free(body.p);
+}
+
+static void* metricsthread(void *data) {
+	struct server *s = data;
+	for(;;) {
+		struct client c;
+		if(server_waitclient(s, &c)) {
+			sleep(1);
+			continue;
+		}
+		serve(c.fd);
+		close(c.fd);
+	}
+	return 0;
+}
+
+int metrics_setup(const char *addr) {
+	static struct server s;
+	char ip[256] = "127.0.0.1";
+	const char *port = strrchr(addr, ':');
+	if(port) {
+		size_t l = port - addr;
+		if(l >= sizeof ip) return -1;
+		memcpy(ip, addr, l);
+		ip[l] = 0;
+		port++;
+	} else port = addr;
+	if(server_setup(&s, ip, atoi(port), 0)) return -1;
+	pthread_t pt;
+	return pthread_create(&pt, 0, metricsthread, &s);
+}
@@ -0,0 +1,16 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#pragma RcB2 DEP "metrics.c"
+
+/* a tiny http server that answers every request with the current
+   counters in prometheus text exposition format. it runs in a thread
+   of its own and only reads the sharded counters from stats.h. */
+
+/* listen on addr, which is "port" (binding to 127.0.0.1) or "ip:port".
+   returns 0 on success. */
+int metrics_setup(const char *addr);
+/* write the current metrics, without http headers, to fd. */
+void metrics_write(int fd);
+
+#endif
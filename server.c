@@ -39,14 +39,18 @@ int server_waitclient(struct server *server, struct client* client) {
 	return ((client->fd = accept(server->fd, (void*)&client->addr, &clen)) == -1)*-1;
 }
 
-void set_socket_options(int fd) {
-	int val = 4 * 1024 * 1024;
-	if(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(int)) < 0) {
+void set_socket_buffers(int fd, int size) {
+	if(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(int)) < 0) {
 		perror("setsockopt SO_SNDBUF");
 	}
-	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(int)) < 0) {
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int)) < 0) {
 		perror("setsockopt SO_RCVBUF");
 	}
+}
+
+void set_socket_options(int fd, int bufsize) {
+	int val;
+	if(bufsize) set_socket_buffers(fd, bufsize);
 	val = 1;
 	if(setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(int)) < 0) {
 		perror("setsockopt KEEPALIVE");
@@ -69,7 +73,7 @@ void set_socket_options(int fd) {
 	}
 }
 
-int server_setup(struct server *server, const char* listenip, unsigned short port) {
+int server_setup(struct server *server, const char* listenip, unsigned short port, int bufsize) {
 	struct addrinfo *ainfo = 0;
 	if(resolve(listenip, port, &ainfo)) return -1;
 	struct addrinfo* p;
@@ -88,7 +92,7 @@ int server_setup(struct server *server, const char* listenip, unsigned short por
 	}
 	freeaddrinfo(ainfo);
 	if(listenfd < 0) return -2;
-	set_socket_options(listenfd);
+	set_socket_options(listenfd, bufsize);
 	if(listen(listenfd, SOMAXCONN) < 0) {
 		close(listenfd);
 		return -3;
@@ -97,7 +101,30 @@ int server_setup(struct server *server, const char* listenip, unsigned short por
 	return 0;
 }
 
-int server_connect(const char* connectip, unsigned short port) {
+int server_defer_accept(struct server *server, unsigned timeout) {
+#if defined(TCP_DEFER_ACCEPT)
+	int val = timeout;
+	return setsockopt(server->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &val, sizeof(int));
+#elif defined(SO_ACCEPTFILTER)
+	struct accept_filter_arg afa = {.af_name = "dataready"};
+	(void) timeout;
+	return setsockopt(server->fd, SOL_SOCKET, SO_ACCEPTFILTER, &afa, sizeof afa);
+#else
+	(void) server; (void) timeout;
+	return 0;
+#endif
+}
+
+int server_fastopen(struct server *server, int qlen) {
+#ifdef TCP_FASTOPEN
+	return setsockopt(server->fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof qlen);
+#else
+	(void) server; (void) qlen;
+	return 0;
+#endif
+}
+
+int server_connect(const char* connectip, unsigned short port, int bufsize) {
 	struct addrinfo *ainfo = 0;
 	if(resolve(connectip, port, &ainfo)) return 1;
 	struct addrinfo* p;
@@ -108,7 +135,7 @@ int server_connect(const char* connectip, unsigned short port) {
 			perror("socket");
 			continue;
 		}
-		set_socket_options(fd);
+		set_socket_options(fd, bufsize);
 		if(connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
 			perror("connect");
 			close(fd);
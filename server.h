@@ -43,9 +43,19 @@ int resolve_sa(const char *host, unsigned short port, union sockaddr_union *res)
 int bindtoip(int fd, union sockaddr_union *bindaddr);
 
 int server_waitclient(struct server *server, struct client* client);
-int server_setup(struct server *server, const char* listenip, unsigned short port);
-int server_connect(const char* connectip, unsigned short port);
-void set_socket_options(int fd);
+/* bufsize is the size of the send and receive buffers, 0 to leave them
+   to the kernel. accepted sockets inherit the listener's. */
+int server_setup(struct server *server, const char* listenip, unsigned short port, int bufsize);
+int server_connect(const char* connectip, unsigned short port, int bufsize);
+/* let accept() return only once the client sent data, or timeout seconds
+   passed. returns 0 on success or where the OS has no such option. */
+int server_defer_accept(struct server *server, unsigned timeout);
+/* accept data in the SYN of clients that hold a fast open cookie, with
+   up to qlen such connections pending. returns 0 on success or where the
+   OS has no such option. */
+int server_fastopen(struct server *server, int qlen);
+void set_socket_options(int fd, int bufsize);
+void set_socket_buffers(int fd, int size);
 
 #endif
 
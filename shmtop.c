@@ -0,0 +1,146 @@
+/*
+   microsocks-top - shows the counters a microsocks started with -z
+   publishes in shared memory, refreshing every few seconds like top.
+   reading them involves no syscalls or locks in the proxy.
+*/
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "statshm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int snapshot(const struct statshm *shm, struct statshm *out) {
+	int tries;
+	for(tries = 0; tries < 1000; tries++) {
+		uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+		if(seq & 1) continue;
+		memcpy(out, (const void*) shm, sizeof *out);
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&shm->seq, memory_order_relaxed) == seq) return 0;
+	}
+	return -1;
+}
+
+static const char *human(char *buf, double bytes) {
+	static const char units[] = "KMGTP";
+	int i = -1;
+	while(bytes >= 1024 && i < 4) {
+		bytes /= 1024;
+		i++;
+	}
+	if(i < 0) sprintf(buf, "%.0f B", bytes);
+	else sprintf(buf, "%.1f %ciB", bytes, units[i]);
+	return buf;
+}
+
+static void show(const struct statshm *cur, const struct statshm *prev) {
+	char b1[32], b2[32];
+	double secs = prev ? (cur->updated - prev->updated) / 1000.0 : 0;
+	size_t i;
+	unsigned long long up = (cur->updated - cur->started) / 1000, open = 0, rejects = 0, prev_rejects = 0;
+	for(i = 0; i < STATS_STATES; i++) open += cur->states[i];
+	for(i = 0; i < REJECT_MAX; i++) {
+		rejects += cur->rejects[i];
+		if(prev) prev_rejects += prev->rejects[i];
+	}
+#define RATE(F) (secs > 0 ? (cur->F - prev->F) / secs : 0)
+	printf("microsocks pid %u%s, up %llud %02llu:%02llu:%02llu\n\n", cur->pid,
+		kill(cur->pid, 0) && errno == ESRCH ? " (not running)" : "",
+		up / 86400, up / 3600 % 24, up / 60 % 60, up % 60);
+	printf("connections %llu:", open);
+	for(i = 0; i < STATS_STATES; i++)
+		printf(" %s %llu", stats_state_names[i], (unsigned long long) cur->states[i]);
+	printf("\naccepted %llu (%.1f/s), rejected %llu (%.1f/s)\n",
+		(unsigned long long) cur->accepts, RATE(accepts),
+		rejects, secs > 0 ? (rejects - prev_rejects) / secs : 0);
+	printf("in %s (%s/s), ", human(b1, cur->bytes_in), human(b2, RATE(bytes_in)));
+	printf("out %s (%s/s)\n\n", human(b1, cur->bytes_out), human(b2, RATE(bytes_out)));
+	printf("%-26s %12s\n", "rejected", "total");
+	for(i = 0; i < REJECT_MAX; i++)
+		printf("%-26s %12llu\n", stats_reject_names[i], (unsigned long long) cur->rejects[i]);
+	printf("\n%-26s %12s\n", "failed requests", "total");
+	for(i = 1; i < STATS_ERRORS; i++)
+		printf("%-26s %12llu\n", stats_error_names[i], (unsigned long long) cur->errors[i]);
+	printf("\n%-12s %9s %9s %9s %9s %12s\n", "latency ms", "p50", "p90", "p99", "p99.9", "count");
+	for(i = 0; i < PHASE_MAX; i++) {
+		const struct statshm_phase *p = &cur->phases[i];
+		printf("%-12s %9.1f %9.1f %9.1f %9.1f %12llu\n", stats_phase_names[i],
+			p->p50 / 1000.0, p->p90 / 1000.0, p->p99 / 1000.0, p->p999 / 1000.0,
+			(unsigned long long) p->count);
+	}
+	printf("\ntcp retransmits");
+	for(i = 0; i < LEG_MAX; i++)
+		printf(" %s %llu", stats_leg_names[i], (unsigned long long) cur->retransmits[i]);
+	printf("\nlog lines dropped %llu\n", (unsigned long long) cur->log_dropped);
+#undef RATE
+}
+
+static int usage(void) {
+	dprintf(2,
+		"usage: microsocks-top [-1] [-d delay] file\n"
+		"shows the stats microsocks -z file publishes, every delay seconds (default 2).\n"
+		"option -1 prints them once and exits.\n");
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	int ch, once = 0, delay = 2;
+	while((ch = getopt(argc, argv, "1d:")) != -1) {
+		switch(ch) {
+			case '1':
+				once = 1;
+				break;
+			case 'd':
+				delay = atoi(optarg);
+				if(delay < 1) delay = 1;
+				break;
+			default:
+				return usage();
+		}
+	}
+	if(optind != argc - 1) return usage();
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+	if(fd == -1 || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if(st.st_size < (off_t) sizeof(struct statshm)) {
+		dprintf(2, "%s: too small for a stats segment\n", argv[optind]);
+		return 1;
+	}
+	const struct statshm *shm = mmap(0, sizeof *shm, PROT_READ, MAP_SHARED, fd, 0);
+	if(shm == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	close(fd);
+	if(shm->magic != STATSHM_MAGIC || shm->version != STATSHM_VERSION || shm->size != sizeof *shm) {
+		dprintf(2, "%s: not a stats segment of this version\n", argv[optind]);
+		return 1;
+	}
+	struct statshm cur, prev;
+	int have_prev = 0;
+	for(;;) {
+		if(snapshot(shm, &cur)) {
+			dprintf(2, "couldn't get a consistent snapshot\n");
+			return 1;
+		}
+		if(!once) printf("\033[H\033[2J");
+		show(&cur, have_prev ? &prev : 0);
+		fflush(stdout);
+		if(once) return 0;
+		prev = cur;
+		have_prev = 1;
+		sleep(delay);
+	}
+}
@@ -0,0 +1,186 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include "slab.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CACHELINE 64
+
+struct object {
+	struct object *next;
+};
+
+struct slab_local;
+
+/* the header at the start of every chunk, which is SLAB_SIZE aligned so
+   an object's chunk is found by masking its address. */
+struct slab {
+	/* links in the owner's partial, empty or released list; full
+	   chunks are on none. only the owner touches anything but owner. */
+	struct slab *next, *prev;
+	struct slab_local *owner;
+	/* freed objects, and how many were carved from the chunk so far:
+	   objects are only carved when needed, so that pages nothing was
+	   ever allocated from are never touched */
+	struct object *free;
+	unsigned used, carved, capacity;
+};
+
+struct slab_list {
+	struct slab *head;
+	unsigned count;
+};
+
+struct slab_local {
+	struct slab_cache *cache;
+	struct slab_list partial, empty, released;
+	/* objects freed by other threads */
+	_Atomic(struct object *) remote;
+};
+
+static struct slab_cache *caches[SLAB_CACHES];
+static atomic_uint ncaches;
+static _Thread_local struct slab_local *locals[SLAB_CACHES];
+
+#define FIRST_OBJECT ((sizeof(struct slab) + CACHELINE - 1) & ~(size_t) (CACHELINE - 1))
+
+int slab_cache_init(struct slab_cache *c, const char *name, size_t size) {
+	size = (size + CACHELINE - 1) & ~(size_t) (CACHELINE - 1);
+	if(size > SLAB_SIZE - FIRST_OBJECT) return -1;
+	unsigned id = atomic_fetch_add(&ncaches, 1);
+	if(id >= SLAB_CACHES) return -1;
+	c->name = name;
+	c->size = size;
+	c->id = id;
+	atomic_init(&c->objects, 0);
+	atomic_init(&c->slabs, 0);
+	atomic_init(&c->empty, 0);
+	atomic_init(&c->released, 0);
+	caches[id] = c;
+	return 0;
+}
+
+struct slab_cache *slab_cache_get(unsigned id) {
+	return id < atomic_load(&ncaches) && id < SLAB_CACHES ? caches[id] : 0;
+}
+
+static void list_add(struct slab_list *l, struct slab *s) {
+	s->prev = 0;
+	s->next = l->head;
+	if(l->head) l->head->prev = s;
+	l->head = s;
+	l->count++;
+}
+
+static void list_del(struct slab_list *l, struct slab *s) {
+	if(s->prev) s->prev->next = s->next;
+	else l->head = s->next;
+	if(s->next) s->next->prev = s->prev;
+	l->count--;
+}
+
+static struct slab *slab_of(void *p) {
+	return (struct slab*) ((uintptr_t) p & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+static void reset(struct slab *s) {
+	s->free = 0;
+	s->used = s->carved = 0;
+}
+
+static struct slab *slab_new(struct slab_local *l) {
+	size_t size = l->cache->size;
+	/* map twice the size and trim, to get the alignment */
+	char *p = mmap(0, 2 * SLAB_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED) return 0;
+	char *start = (char*) (((uintptr_t) p + SLAB_SIZE - 1) & ~(uintptr_t) (SLAB_SIZE - 1));
+	if(start > p) munmap(p, start - p);
+	munmap(start + SLAB_SIZE, p + SLAB_SIZE - start);
+	struct slab *s = (void*) start;
+	s->owner = l;
+	s->capacity = (SLAB_SIZE - FIRST_OBJECT) / size;
+	reset(s);
+	atomic_fetch_add_explicit(&l->cache->slabs, 1, memory_order_relaxed);
+	return s;
+}
+
+static struct slab_local *local(struct slab_cache *c) {
+	struct slab_local *l = locals[c->id];
+	if(!l && (l = calloc(1, sizeof *l))) {
+		l->cache = c;
+		locals[c->id] = l;
+	}
+	return l;
+}
+
+static void local_free(struct slab_local *l, struct slab *s, struct object *o) {
+	struct slab_cache *c = l->cache;
+	o->next = s->free;
+	s->free = o;
+	if(s->used-- == s->capacity) list_add(&l->partial, s);
+	atomic_fetch_sub_explicit(&c->objects, 1, memory_order_relaxed);
+	if(s->used) return;
+	list_del(&l->partial, s);
+	if(l->empty.count < SLAB_KEEP_EMPTY) {
+		list_add(&l->empty, s);
+		atomic_fetch_add_explicit(&c->empty, 1, memory_order_relaxed);
+		return;
+	}
+	/* the header's page stays, the others read back as zeroes and are
+	   carved up again when the chunk is reused */
+	long page = sysconf(_SC_PAGESIZE);
+	madvise((char*) s + page, SLAB_SIZE - page, MADV_DONTNEED);
+	reset(s);
+	list_add(&l->released, s);
+	atomic_fetch_add_explicit(&c->released, 1, memory_order_relaxed);
+}
+
+static void drain_remote(struct slab_local *l) {
+	struct object *o = atomic_exchange_explicit(&l->remote, 0, memory_order_acquire);
+	while(o) {
+		struct object *next = o->next;
+		local_free(l, slab_of(o), o);
+		o = next;
+	}
+}
+
+void *slab_alloc(struct slab_cache *c) {
+	struct slab_local *l = local(c);
+	struct slab *s;
+	if(!l) return 0;
+	if(!l->partial.head) drain_remote(l);
+	if(!(s = l->partial.head)) {
+		if((s = l->empty.head)) {
+			list_del(&l->empty, s);
+			atomic_fetch_sub_explicit(&c->empty, 1, memory_order_relaxed);
+		} else if((s = l->released.head)) {
+			list_del(&l->released, s);
+			atomic_fetch_sub_explicit(&c->released, 1, memory_order_relaxed);
+		} else if(!(s = slab_new(l)))
+			return 0;
+		list_add(&l->partial, s);
+	}
+	struct object *o = s->free;
+	if(o) s->free = o->next;
+	else o = (void*) ((char*) s + FIRST_OBJECT + s->carved++ * c->size);
+	if(++s->used == s->capacity) list_del(&l->partial, s);
+	atomic_fetch_add_explicit(&c->objects, 1, memory_order_relaxed);
+	return o;
+}
+
+void slab_free(struct slab_cache *c, void *p) {
+	struct slab *s = slab_of(p);
+	struct slab_local *l = s->owner;
+	struct object *o = p;
+	if(l == locals[c->id]) {
+		local_free(l, s, o);
+		return;
+	}
+	struct object *head = atomic_load_explicit(&l->remote, memory_order_relaxed);
+	do o->next = head;
+	while(!atomic_compare_exchange_weak_explicit(&l->remote, &head, o,
+	      memory_order_release, memory_order_relaxed));
+}
@@ -0,0 +1,49 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#pragma RcB2 DEP "slab.c"
+
+/* fixed size objects, like the state of a connection, carved out of
+   SLAB_SIZE chunks. every thread that allocates has chunks of its own,
+   so allocating and freeing take no lock and touch no shared cache line.
+   an object freed by another thread is pushed onto its owner's lock-free
+   remote free list, which the owner drains once it runs out of free
+   objects.
+
+   chunks that become empty are kept for reuse, up to SLAB_KEEP_EMPTY per
+   thread and cache. the memory of further ones goes back to the kernel
+   with madvise(MADV_DONTNEED), so rss comes back down after a spike,
+   while the address space stays reserved for the next one.
+
+   threads must not exit while objects they allocated are alive. */
+
+#define SLAB_SIZE (64*1024)
+#define SLAB_CACHES 4
+#ifndef SLAB_KEEP_EMPTY
+#define SLAB_KEEP_EMPTY 2
+#endif
+
+struct slab_cache {
+	const char *name;
+	/* rounded up to a cache line, so neighbouring objects used by
+	   different threads don't share one */
+	size_t size;
+	unsigned id;
+	/* the numbers of objects handed out, and of chunks by state */
+	atomic_ullong objects, slabs, empty, released;
+};
+
+/* returns 0 on success, -1 if there are SLAB_CACHES caches already or
+   size doesn't fit into a chunk. */
+int slab_cache_init(struct slab_cache *c, const char *name, size_t size);
+/* returns 0 if out of memory. */
+void *slab_alloc(struct slab_cache *c);
+void slab_free(struct slab_cache *c, void *p);
+
+/* the caches set up so far, for the metrics; 0 past the last one. */
+struct slab_cache *slab_cache_get(unsigned id);
+
+#endif
@@ -0,0 +1,127 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "sockbuf.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *sockbuf_kind_names[SOCKBUF_KINDS] = {
+	[SOCKBUF_CLIENT] = "client",
+	[SOCKBUF_UPSTREAM] = "upstream",
+	[SOCKBUF_LINK] = "link",
+};
+
+struct sockbuf_policy sockbuf_policies[SOCKBUF_KINDS] = {
+	[SOCKBUF_CLIENT] = {SOCKBUF_FIXED, SOCKBUF_DEFAULT},
+	[SOCKBUF_UPSTREAM] = {SOCKBUF_FIXED, SOCKBUF_DEFAULT},
+	[SOCKBUF_LINK] = {SOCKBUF_FIXED, SOCKBUF_DEFAULT},
+};
+
+/* a number with an optional suffix k, m or g, multiplying by unit,
+   unit squared and so on. returns 0 if there is none or anything else
+   follows. */
+static unsigned long long number(const char *s, unsigned long long unit) {
+	char *p;
+	unsigned long long v = strtoull(s, &p, 10);
+	if(p == s) return 0;
+	switch(*p) {
+		case 'g': case 'G': v *= unit; /* fall through */
+		case 'm': case 'M': v *= unit; /* fall through */
+		case 'k': case 'K': v *= unit;
+			p++;
+	}
+	return *p ? 0 : v;
+}
+
+static int policy(int kind, const char *s, void *arg) {
+	struct sockbuf_policy p;
+	size_t i;
+	(void) arg;
+	if(!strcmp(s, "auto"))
+		p = (struct sockbuf_policy) {SOCKBUF_AUTO, 0};
+	else if(!strncmp(s, "bdp:", 4))
+		p = (struct sockbuf_policy) {SOCKBUF_BDP, number(s + 4, 1000)};
+	else {
+		p = (struct sockbuf_policy) {SOCKBUF_FIXED, number(s, 1024)};
+		if(p.value > INT_MAX) return -1;
+	}
+	if(!p.value && p.mode != SOCKBUF_AUTO) return -1;
+	for(i = 0; i < SOCKBUF_KINDS; i++)
+		if(kind == -1 || kind == (int) i) sockbuf_policies[i] = p;
+	return 0;
+}
+
+int sockbuf_each(const char *spec, int (*fn)(int kind, const char *value, void *arg), void *arg) {
+	const char *s = spec;
+	char value[32];
+	for(;;) {
+		size_t i, n = strcspn(s, ",");
+		const char *eq = memchr(s, '=', n);
+		int kind = -1;
+		if(eq) {
+			for(i = 0; i < SOCKBUF_KINDS; i++)
+				if(strlen(sockbuf_kind_names[i]) == (size_t) (eq - s) &&
+				   !strncmp(s, sockbuf_kind_names[i], eq - s))
+					kind = i;
+			if(kind == -1) return -1;
+			n -= eq + 1 - s;
+			s = eq + 1;
+		}
+		if(!n || n >= sizeof value) return -1;
+		memcpy(value, s, n);
+		value[n] = 0;
+		if(fn(kind, value, arg)) return -1;
+		s += n;
+		if(!*s++) return 0;
+	}
+}
+
+int sockbuf_parse(const char *spec) {
+	return sockbuf_each(spec, policy, 0);
+}
+
+int sockbuf_size(enum sockbuf_kind kind, unsigned rtt_us) {
+	const struct sockbuf_policy *p = &sockbuf_policies[kind];
+	unsigned long long bdp;
+	switch(p->mode) {
+		case SOCKBUF_FIXED:
+			return p->value;
+		case SOCKBUF_BDP:
+			if(!rtt_us) return 0;
+			bdp = p->value / 8 * rtt_us / 1000000;
+			if(bdp < SOCKBUF_BDP_MIN) bdp = SOCKBUF_BDP_MIN;
+			if(bdp > SOCKBUF_BDP_MAX) bdp = SOCKBUF_BDP_MAX;
+			/* whole pages, which also keeps small rtt changes from
+			   resizing the buffers every time */
+			return (bdp + 4095) & ~4095ULL;
+		default:
+			return 0;
+	}
+}
+
+static pthread_once_t auto_once = PTHREAD_ONCE_INIT;
+static int auto_max;
+
+/* the last of the three numbers in a tcp_rmem or tcp_wmem file */
+static int read_max(const char *path) {
+	FILE *f = fopen(path, "r");
+	int min, def, max;
+	if(!f) return 0;
+	if(fscanf(f, "%d %d %d", &min, &def, &max) != 3) max = 0;
+	fclose(f);
+	return max;
+}
+
+static void auto_init(void) {
+	int r = read_max("/proc/sys/net/ipv4/tcp_rmem");
+	int w = read_max("/proc/sys/net/ipv4/tcp_wmem");
+	auto_max = r > w ? r : w;
+	if(auto_max <= 0) auto_max = SOCKBUF_DEFAULT;
+}
+
+int sockbuf_auto_max(void) {
+	pthread_once(&auto_once, auto_init);
+	return auto_max;
+}
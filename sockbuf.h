@@ -0,0 +1,65 @@
+#ifndef SOCKBUF_H
+#define SOCKBUF_H
+
+#pragma RcB2 DEP "sockbuf.c"
+
+/* how the send and receive buffers of sockets are sized (-s), separately
+   for each kind of socket:
+     client    socks clients, accepted on the listening port, or on the
+               -C port when -C is given
+     upstream  the targets of socks requests
+     link      the reverse tunnel: the connection to -c, or the one
+               accepted on the listening port when -C is given
+   with one of these policies:
+     auto      leave it to the kernel, which starts small and grows the
+               buffers along with the connection's throughput
+     SIZE      fixed at SIZE bytes (suffix k or m), which turns autotuning
+               off for the socket
+     bdp:RATE  the bandwidth-delay product of RATE bits per second (suffix
+               k, m or g) and the connection's rtt, as measured during the
+               tcp handshake and then with every TCP_INFO sample. until
+               there is an rtt, the kernel tunes the socket.
+   linux caps sizes set by an unprivileged process at net.core.rmem_max
+   and net.core.wmem_max. */
+
+enum sockbuf_kind {
+	SOCKBUF_CLIENT,
+	SOCKBUF_UPSTREAM,
+	SOCKBUF_LINK,
+	SOCKBUF_KINDS
+};
+extern const char *sockbuf_kind_names[SOCKBUF_KINDS];
+
+enum sockbuf_mode {
+	SOCKBUF_FIXED,
+	SOCKBUF_AUTO,
+	SOCKBUF_BDP,
+};
+
+struct sockbuf_policy {
+	enum sockbuf_mode mode;
+	/* bytes, or bits per second for bdp */
+	unsigned long long value;
+};
+
+/* what every kind gets unless told otherwise */
+#define SOCKBUF_DEFAULT (4*1024*1024)
+#define SOCKBUF_BDP_MIN (64*1024)
+#define SOCKBUF_BDP_MAX (64*1024*1024)
+
+extern struct sockbuf_policy sockbuf_policies[SOCKBUF_KINDS];
+
+/* parses a comma-separated list of [kind=]policy into sockbuf_policies.
+   a policy without kind applies to all of them. returns 0 on success. */
+int sockbuf_parse(const char *spec);
+/* calls fn for every [kind=]value in the comma-separated list spec, with
+   kind -1 where it is left out. returns 0 if spec is well-formed and fn
+   returned 0 for every entry, -1 otherwise. */
+int sockbuf_each(const char *spec, int (*fn)(int kind, const char *value, void *arg), void *arg);
+/* the size for a socket of kind with an rtt of rtt_us, 0 if unknown.
+   0 means leaving it to the kernel. */
+int sockbuf_size(enum sockbuf_kind kind, unsigned rtt_us);
+/* the most the kernel grows autotuned buffers to. */
+int sockbuf_auto_max(void);
+
+#endif
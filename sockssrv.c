@@ -35,13 +35,36 @@
 #include <limits.h>
 #include <stdatomic.h>
 #include <time.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include "server.h"
 #include "sblist.h"
+#include "admission.h"
+#include "clock.h"
+#include "timerwheel.h"
+#include "stats.h"
+#include "metrics.h"
+#include "log.h"
+#include "topk.h"
+#include "statshm.h"
+#include "admin.h"
+#include "tcpinfo.h"
+#include "trace.h"
+#include "bufpool.h"
+#include "budget.h"
+#include "sockbuf.h"
+#include "congestion.h"
+#include "slab.h"
+#include "zerocopy.h"
 
-/* timeout in microseconds on resource exhaustion to prevent excessive
-   cpu usage. */
-#ifndef FAILURE_TIMEOUT
-#define FAILURE_TIMEOUT 64
+/* size of the lazy mode waiting room if not given with -n. */
+#ifndef WAITROOM_DEFAULT
+#define WAITROOM_DEFAULT 1024
+#endif
+
+/* connections with data in their SYN that may wait for accept() */
+#ifndef FASTOPEN_QLEN
+#define FASTOPEN_QLEN 256
 #endif
 
 #ifndef MAX
@@ -67,6 +90,19 @@
 #endif
 
 static int quiet;
+/* the main thread owns the list of threads. it takes threads_lock only
+   to change the list, so that the admin thread can walk it meanwhile. */
+static sblist *threads_all;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+/* struct threads are allocated and freed by the main thread */
+static struct slab_cache thread_slab;
+/* log channel of the access log (-L), or -1 */
+static int access_log = -1;
+/* log channel of the connection trace (-x), or -1, when it started
+   (monotonic us) and the salt for its destination hashes */
+static int trace_log = -1;
+static unsigned long long trace_started;
+static uint64_t trace_key;
 static const char* auth_user;
 static const char* auth_pass;
 static sblist* auth_ips;
@@ -74,12 +110,60 @@ static pthread_rwlock_t auth_ips_lock = PTHREAD_RWLOCK_INITIALIZER;
 static const struct server* server;
 static union sockaddr_union bind_addr = {.v4.sin_family = AF_UNSPEC};
 static struct server* connector_server;
-static atomic_int bytes_out, bytes_in;
+/* set with -c, where socks requests come in over the reverse tunnel */
+static int client_link;
+/* tcp fast open (-f) */
+static int fastopen;
+/* MSG_ZEROCOPY for bulk flows (-Z) */
+static int zerocopy;
+/* set while the main thread waits for connections to go away, so that
+   exiting threads know to wake it up through wakefds. */
+static atomic_int accept_paused;
+static int wakefds[2];
+/* cap on connections that didn't get past authentication yet. */
+static atomic_uint max_preauth;
+static atomic_uint preauth_count;
+
+/* timeouts in seconds, 0 meaning none. every connection refers to the
+   set of the listener it came in on. */
+struct timeouts {
+	atomic_uint handshake, connect, idle;
+};
+static struct timeouts socks_timeouts = {.idle = 15*60};
+
+/* all connection timeouts live in one wheel, advanced by timerthread()
+   every TICK_MS. the lock is never taken on the relay path: activity is
+   recorded in last_active, and an expiring idle timer that finds recent
+   activity simply re-arms itself. */
+#define TICK_MS 100
+static struct timerwheel timers;
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the time of the last tick, cheap enough to read for every relayed chunk */
+static atomic_ullong coarse_now;
+
+/* a relayed connection samples TCP_INFO of both its sockets at most every
+   TCPINFO_INTERVAL ms while there is traffic, and all connections
+   together at most TCPINFO_RATE times per second: timerthread() refills
+   the budget every tick. */
+#ifndef TCPINFO_INTERVAL
+#define TCPINFO_INTERVAL 10000
+#endif
+#ifndef TCPINFO_RATE
+#define TCPINFO_RATE 1000
+#endif
+static atomic_int tcpinfo_budget;
+
+/* when the memory budget is exhausted, connections whose relay buffer
+   class is at least this pause reading, so the fastest producers, which
+   hold the biggest buffers, back off first. BUFPOOL_CLASSES for none,
+   set by timerthread() every tick. */
+static atomic_uint relay_pause_cls = BUFPOOL_CLASSES;
 
 enum socksstate {
 	SS_1_CONNECTED,
 	SS_2_NEED_AUTH, /* skipped if NO_AUTH method supported */
 	SS_3_AUTHED,
+	SS_4_RELAYING,
 };
 
 enum authmethod {
@@ -101,25 +185,181 @@ enum errorcode {
 	EC_ADDRESSTYPE_NOT_SUPPORTED = 8,
 };
 
+/* what a connection is busy with, in order. */
+enum doing {
+	DOING_WAITING, /* for the other side in relay mode (-C) */
+	DOING_GREETING,
+	DOING_AUTH,
+	DOING_REQUEST,
+	DOING_RESOLVING,
+	DOING_CONNECTING,
+	DOING_RELAYING,
+};
+
+enum close_reason {
+	CLOSE_EOF,
+	CLOSE_ERROR,
+	CLOSE_CLIENT_GONE, /* before sending a request */
+	CLOSE_AUTH_FAILED,
+	CLOSE_REQUEST_FAILED,
+	CLOSE_HANDSHAKE_TIMEOUT,
+	CLOSE_CONNECT_TIMEOUT,
+	CLOSE_IDLE_TIMEOUT,
+	CLOSE_KILLED, /* by the admin socket */
+};
+
+/* the access log line of a connection, filled in as it goes along and
+   queued for the log thread when it closes. durations are -1 for phases
+   the connection didn't get to. */
+struct access_record {
+	union sockaddr_union client, target;
+	long long closed_ms; /* wall clock */
+	unsigned long long bytes_in, bytes_out;
+	long long handshake_us, dns_us, connect_us, total_us;
+	unsigned short port;
+	unsigned char reason, error, authed;
+	/* congestion_get() ids by leg, 0 until relaying starts */
+	unsigned char congestion[LEG_MAX];
+	/* only the bytes up to the terminator are queued */
+	char host[256];
+};
+_Static_assert(offsetof(struct access_record, host) + 256 <= LOG_PAYLOAD,
+	"access log records must fit a log slot");
+
 struct thread {
 	pthread_t pt;
+	/* unique, for the admin socket to refer to */
+	unsigned long long id;
 	struct client client;
 	enum socksstate state;
 	volatile int  done;
+	int preauth;
+	/* whether admission_release() is owed */
+	int ip_counted;
+	unsigned long long accepted, queued;
+	/* when the connect request came in, 0 until then */
+	unsigned long long request_at;
+	const struct timeouts *to;
+	/* protected by timers_lock. connecting is set once the connect
+	   timeout replaced the handshake one. */
+	struct timer timer;
+	int remotefd, expired, connecting;
+	/* 0 until relaying starts */
+	atomic_ullong last_active;
+	struct access_record acc;
+	/* relayed bytes not yet added to the top lists */
+	unsigned long long top_pending;
+	/* when to sample TCP_INFO next, and the retransmits seen so far */
+	unsigned long long next_sample;
+	unsigned retrans[LEG_MAX];
+	/* the size of the sockets' buffers, 0 while the kernel tunes them,
+	   and the bytes charged to the memory budget for them */
+	int bufsize[LEG_MAX];
+	size_t sockbuf[LEG_MAX];
+	/* what the thread is busy with, and the bytes relayed so far. only
+	   written by the connection's own thread, and read by the admin
+	   socket, so plain relaxed loads and stores will do. */
+	atomic_int doing;
+	atomic_ullong bytes_in, bytes_out;
+	/* only filled in with -x */
+	struct trace_conn trace;
+	/* set under timers_lock, closed once the descriptors are about to
+	   be closed and must not be shut down anymore. */
+	int closed, killed;
 };
 
+/* relayed bytes are added to the top lists in chunks of this size, so
+   the relay path only takes their lock every so often. */
+#define TOP_CHUNK (1024*1024)
+
 #ifndef CONFIG_LOG
 #define CONFIG_LOG 1
 #endif
 #if CONFIG_LOG
-/* we log to stderr because it's not using line buffering, i.e. malloc which would need
-   locking when called from different threads. for the same reason we use dprintf,
-   which writes directly to an fd. */
-#define dolog(...) do { if(!quiet) dprintf(2, __VA_ARGS__); } while(0)
+/* log lines are queued for the log thread (see log.h), which writes them to
+   stderr, so a slow reader on the other end never stalls a connection. */
+#define dolog(...) do { if(!quiet) log_printf(__VA_ARGS__); } while(0)
 #else
 static void dolog(const char* fmt, ...) { }
 #endif
 
+static void set_doing(struct thread *t, enum doing what) {
+	atomic_store_explicit(&t->doing, what, memory_order_release);
+}
+
+static void add_bytes(atomic_ullong *c, size_t n) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void conn_expired(struct timer *tm) {
+	struct thread *t = (void*) ((char*) tm - offsetof(struct thread, timer));
+	unsigned long long last = atomic_load_explicit(&t->last_active, memory_order_relaxed);
+	unsigned idle = atomic_load_explicit(&t->to->idle, memory_order_relaxed);
+	if(last) {
+		/* relaying, so this is the idle timer */
+		if(!idle) return;
+		if(last + idle * 1000ULL > atomic_load_explicit(&coarse_now, memory_order_relaxed)) {
+			tw_arm(&timers, tm, (last + idle * 1000ULL) / TICK_MS + 1);
+			return;
+		}
+	}
+	/* wakes up whatever the thread is blocked in, be it recv(),
+	   connect() or poll(), which then see an error or EOF. the connect
+	   timeout leaves the client socket alone, so the client can still
+	   be told about it, during dns resolution as well. */
+	t->expired = 1;
+	if(t->remotefd != -1) shutdown(t->remotefd, SHUT_RDWR);
+	if(last || !t->connecting) shutdown(t->client.fd, SHUT_RDWR);
+}
+
+/* arms the connection's timer to fire at the absolute time deadline (ms),
+   or disarms it if deadline is 0. remotefd is the upstream socket to
+   shut down on expiry, if any. */
+static void conn_deadline(struct thread *t, unsigned long long deadline, int remotefd) {
+	pthread_mutex_lock(&timers_lock);
+	t->remotefd = remotefd;
+	if(deadline) tw_arm(&timers, &t->timer, deadline / TICK_MS + 1);
+	else tw_cancel(&timers, &t->timer);
+	pthread_mutex_unlock(&timers_lock);
+}
+
+/* same, but relative to now. */
+static void conn_timeout(struct thread *t, unsigned secs, int remotefd) {
+	conn_deadline(t, secs ? clock_ms() + secs * 1000ULL : 0, remotefd);
+}
+
+static unsigned pause_class(void) {
+	struct bufpool_stats bp;
+	unsigned cls = BUFPOOL_CLASSES - 1;
+	if(budget_level() != BUDGET_EXHAUSTED) return BUFPOOL_CLASSES;
+	/* the biggest class in use, but connections relaying through the
+	   smallest buffers are left alone */
+	for(; cls > 1; cls--) {
+		bufpool_stats(cls, &bp);
+		if(bp.in_use) break;
+	}
+	return cls;
+}
+
+static void* timerthread(void *data) {
+	unsigned ticks = 0;
+	(void) data;
+	for(;;) {
+		usleep(TICK_MS * 1000);
+		/* the shared memory stats are refreshed every second */
+		if(++ticks % (1000 / TICK_MS) == 0) statshm_publish();
+		unsigned long long now = clock_ms();
+		atomic_store_explicit(&coarse_now, now, memory_order_relaxed);
+		atomic_store_explicit(&tcpinfo_budget, TCPINFO_RATE * TICK_MS / 1000, memory_order_relaxed);
+		atomic_store_explicit(&relay_pause_cls, pause_class(), memory_order_relaxed);
+		pthread_mutex_lock(&timers_lock);
+		tw_advance(&timers, now / TICK_MS);
+		pthread_mutex_unlock(&timers_lock);
+		zerocopy_collect(now);
+	}
+	return 0;
+}
+
 static struct addrinfo* addr_choose(struct addrinfo* list, union sockaddr_union* bindaddr) {
 	int af = SOCKADDR_UNION_AF(bindaddr);
 	if(af == AF_UNSPEC) return list;
@@ -129,7 +369,57 @@ static struct addrinfo* addr_choose(struct addrinfo* list, union sockaddr_union*
 	return list;
 }
 
-static int connect_socks_target(unsigned char *buf, size_t n, struct client *client) {
+/* what the "connected to" line is made of. only the bytes of host up to
+   its terminator are queued, and inet_ntop() runs in the log thread. */
+struct connect_record {
+	int fd;
+	unsigned short port;
+	union sockaddr_union addr;
+	char host[256];
+};
+
+static size_t format_connect(char *out, size_t size, const void *data) {
+	const struct connect_record *r = data;
+	char clientname[INET6_ADDRSTRLEN];
+	inet_ntop(SOCKADDR_UNION_AF(&r->addr), SOCKADDR_UNION_ADDRESS(&r->addr), clientname, sizeof clientname);
+	return snprintf(out, size, "client[%d] %s: connected to %s:%d\n", r->fd, clientname, r->host, r->port);
+}
+
+static enum sockbuf_kind leg_kind(enum stats_leg leg) {
+	/* with -C the tunnel comes in on the listening port, and the socks
+	   client on the -C port */
+	if(leg == LEG_CLIENT) return client_link || connector_server ? SOCKBUF_LINK : SOCKBUF_CLIENT;
+	return connector_server ? SOCKBUF_CLIENT : SOCKBUF_UPSTREAM;
+}
+
+/* sizes the buffers of a connection's socket by the policy for its kind
+   (see sockbuf.h), as far as the memory budget allows right now, and
+   charges them to the budget until the connection closes. t->bufsize
+   must hold what the socket has already. rtt_us is the connection's rtt,
+   0 to look it up if the policy needs it. */
+static void size_socket(struct thread *t, enum stats_leg leg, int fd, unsigned rtt_us) {
+	enum sockbuf_kind kind = leg_kind(leg);
+	struct tcpinfo i;
+	if(!rtt_us && sockbuf_policies[kind].mode == SOCKBUF_BDP && !tcpinfo_sample(fd, &i))
+		rtt_us = i.rtt;
+	/* autotuned buffers are charged what they may grow to, and get
+	   fixed ones instead when the budget can't afford that. once fixed,
+	   a socket can't go back to autotuning. */
+	int want = sockbuf_size(kind, rtt_us), max = want ? want : sockbuf_auto_max();
+	int size = budget_sockbuf(max);
+	if(!want && size == max && !t->bufsize[leg]) size = 0;
+	if(size != t->bufsize[leg]) set_socket_buffers(fd, size);
+	t->bufsize[leg] = size;
+	size_t charge = 2 * (size_t) (size ? size : max);
+	budget_charge(BUDGET_SOCKET, charge, 1);
+	budget_release(BUDGET_SOCKET, t->sockbuf[leg]);
+	t->sockbuf[leg] = charge;
+}
+
+/* buf holds n bytes, the request and whatever the client sent right
+   behind it, and has room for size. */
+static int connect_socks_target(unsigned char *buf, size_t n, size_t size, struct thread *t) {
+	struct client *client = &t->client;
 	if(n < 5) return -EC_GENERAL_FAILURE;
 	if(buf[0] != 5) return -EC_GENERAL_FAILURE;
 	if(buf[1] != 1) return -EC_COMMAND_NOT_SUPPORTED; /* we support only CONNECT method */
@@ -147,6 +437,7 @@ static int connect_socks_target(unsigned char *buf, size_t n, struct client *cli
 			/* fall through */
 		case 1: /* ipv4 */
 			if(n < minlen) return -EC_GENERAL_FAILURE;
+			t->trace.flags |= buf[3];
 			if(namebuf != inet_ntop(af, buf+4, namebuf, sizeof namebuf))
 				return -EC_GENERAL_FAILURE; /* malformed or too long addr */
 			break;
@@ -156,19 +447,38 @@ static int connect_socks_target(unsigned char *buf, size_t n, struct client *cli
 			if(n < 4 + 2 + l + 1) return -EC_GENERAL_FAILURE;
 			memcpy(namebuf, buf+4+1, l);
 			namebuf[l] = 0;
+			t->trace.flags |= buf[3];
 			break;
 		default:
 			return -EC_ADDRESSTYPE_NOT_SUPPORTED;
 	}
 	unsigned short port;
 	port = (buf[minlen-2] << 8) | buf[minlen-1];
+	/* the connect timeout covers dns resolution too, but getaddrinfo()
+	   can't be interrupted, so it only takes effect once that returned. */
+	pthread_mutex_lock(&timers_lock);
+	t->connecting = 1;
+	pthread_mutex_unlock(&timers_lock);
+	conn_timeout(t, atomic_load_explicit(&t->to->connect, memory_order_relaxed), -1);
 	/* there's no suitable errorcode in rfc1928 for dns lookup failure */
-	if(resolve(namebuf, port, &remote)) return -EC_GENERAL_FAILURE;
+	memcpy(t->acc.host, namebuf, sizeof namebuf);
+	t->acc.port = port;
+	/* the admin socket reads the host once it sees this */
+	set_doing(t, DOING_RESOLVING);
+	unsigned long long start = clock_us();
+	if(resolve(namebuf, port, &remote))
+		return t->expired ? -EC_TTL_EXPIRED : -EC_GENERAL_FAILURE;
+	t->acc.dns_us = clock_us() - start;
+	stats_time(PHASE_DNS, t->acc.dns_us);
 	struct addrinfo* raddr = addr_choose(remote, &bind_addr);
 	int fd = socket(raddr->ai_family, SOCK_STREAM, 0);
 	if(fd == -1) {
 		eval_errno:
-		if(fd != -1) close(fd);
+		if(fd != -1) {
+			conn_timeout(t, 0, -1);
+			if(t->expired) errno = ETIMEDOUT;
+			close(fd);
+		}
 		freeaddrinfo(remote);
 		switch(errno) {
 			case ETIMEDOUT:
@@ -190,20 +500,64 @@ static int connect_socks_target(unsigned char *buf, size_t n, struct client *cli
 			return -EC_GENERAL_FAILURE;
 		}
 	}
-	set_socket_options(fd);
+	set_socket_options(fd, 0);
+	size_socket(t, LEG_UPSTREAM, fd, 0);
+	congestion_set(fd, SOCKBUF_UPSTREAM);
+	pthread_mutex_lock(&timers_lock);
+	t->remotefd = fd;
+	pthread_mutex_unlock(&timers_lock);
+	if(t->expired) {
+		errno = ETIMEDOUT;
+		goto eval_errno;
+	}
 	if(SOCKADDR_UNION_AF(&bind_addr) == raddr->ai_family &&
 	   bindtoip(fd, &bind_addr) == -1)
 		goto eval_errno;
+	memcpy(&t->acc.target, raddr->ai_addr, MIN(raddr->ai_addrlen, sizeof t->acc.target));
+	/* data a client pipelined behind the request is relayed right away,
+	   and with -f goes out in the SYN. connect() then only arms the socket
+	   if there is a cookie for the target, and the write below does the
+	   handshake, so errors still turn up before the reply. */
+	size_t early = n - minlen, off;
+	ssize_t m;
+	int tfo = 0;
+	if(fastopen) {
+		m = recv(client->fd, buf + n, size - n, MSG_DONTWAIT);
+		if(m > 0) early += m;
+#ifdef TCP_FASTOPEN_CONNECT
+		tfo = early && !setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &(int){1}, sizeof(int));
+#endif
+	}
+	set_doing(t, DOING_CONNECTING);
+	start = clock_us();
 	if(connect(fd, raddr->ai_addr, raddr->ai_addrlen) == -1)
 		goto eval_errno;
+	for(off = 0; off < early; off += m)
+		if((m = write(fd, buf + minlen + off, early - off)) < 0)
+			goto eval_errno;
+	t->acc.connect_us = clock_us() - start;
+	if(tfo) {
+		struct tcpinfo i;
+		stats_inc(fastopen_tries);
+		if(!tcpinfo_sample(fd, &i) && i.syn_data) stats_inc(fastopen_syn_data[LEG_UPSTREAM]);
+	}
+	if(early) {
+		stats_add(stats_local(), bytes_out, early);
+		add_bytes(&t->bytes_out, early);
+		t->top_pending += early;
+		if(trace_log != -1)
+			t->trace.bytes[trace_bucket((clock_us() - t->accepted) / 1000)][TRACE_UP] += early;
+	}
+	stats_time(PHASE_CONNECT, t->acc.connect_us);
+	/* the handshake measured the rtt */
+	if(sockbuf_policies[SOCKBUF_UPSTREAM].mode == SOCKBUF_BDP) size_socket(t, LEG_UPSTREAM, fd, 0);
 
 	freeaddrinfo(remote);
-	if(CONFIG_LOG) {
-		char clientname[256];
-		af = SOCKADDR_UNION_AF(&client->addr);
-		void *ipdata = SOCKADDR_UNION_ADDRESS(&client->addr);
-		inet_ntop(af, ipdata, clientname, sizeof clientname);
-		dolog("client[%d] %s: connected to %s:%d\n", client->fd, clientname, namebuf, port);
+	if(CONFIG_LOG && !quiet) {
+		struct connect_record r = {.fd = client->fd, .port = port, .addr = client->addr};
+		size_t l = strlen(namebuf);
+		memcpy(r.host, namebuf, l + 1);
+		log_write(0, format_connect, &r, offsetof(struct connect_record, host) + l + 1);
 	}
 	return fd;
 }
@@ -271,52 +625,319 @@ static void send_error(int fd, enum errorcode ec) {
 	write(fd, buf, 10);
 }
 
-static void copyloop(int fd1, int fd2) {
+static size_t client_key(const struct thread *t, const void **key) {
+	*key = SOCKADDR_UNION_ADDRESS(&t->client.addr);
+	switch(SOCKADDR_UNION_AF(&t->client.addr)) {
+		case AF_INET: return 4;
+		case AF_INET6: return 16;
+	}
+	return 0;
+}
+
+static void top_connection(struct thread *t) {
+	const void *key;
+	size_t len = client_key(t, &key);
+	if(len) topk_add(TOP_CLIENT_CONNS, key, len, 1);
+	if(t->acc.host[0]) topk_add(TOP_DEST_CONNS, t->acc.host, strlen(t->acc.host), 1);
+}
+
+static void top_flush(struct thread *t) {
+	const void *key;
+	size_t len = client_key(t, &key);
+	if(!t->top_pending) return;
+	if(len) topk_add(TOP_CLIENT_BYTES, key, len, t->top_pending);
+	if(t->acc.host[0]) topk_add(TOP_DEST_BYTES, t->acc.host, strlen(t->acc.host), t->top_pending);
+	t->top_pending = 0;
+}
+
+static void sample_tcp(struct thread *t, int fd1, int fd2, unsigned long long now) {
+	int fds[LEG_MAX] = {[LEG_CLIENT] = fd1, [LEG_UPSTREAM] = fd2};
+	size_t leg;
+	t->next_sample = now + TCPINFO_INTERVAL;
+	if(atomic_load_explicit(&tcpinfo_budget, memory_order_relaxed) <= 0 ||
+	   atomic_fetch_sub_explicit(&tcpinfo_budget, 1, memory_order_relaxed) <= 0)
+		return;
+	for(leg = 0; leg < LEG_MAX; leg++) {
+		struct tcpinfo i;
+		if(tcpinfo_sample(fds[leg], &i)) continue;
+		stats_tcp(leg, TCP_RTT, i.rtt);
+		stats_tcp(leg, TCP_RTTVAR, i.rttvar);
+		stats_tcp(leg, TCP_CWND, i.cwnd);
+		if(i.have_delivery_rate) stats_tcp(leg, TCP_DELIVERY_RATE, i.delivery_rate);
+		if(i.have_notsent) stats_tcp(leg, TCP_NOTSENT, i.notsent);
+		if(i.total_retrans > t->retrans[leg])
+			stats_add(stats_local(), retransmits[leg], i.total_retrans - t->retrans[leg]);
+		t->retrans[leg] = i.total_retrans;
+		/* follows the rtt, and the memory budget */
+		if(sockbuf_policies[leg_kind(leg)].mode == SOCKBUF_BDP && i.rtt)
+			size_socket(t, leg, fds[leg], i.rtt);
+	}
+}
+
+/* the relay buffer comes from the shared pool (see bufpool.h). it starts
+   at RELAY_START_CLASS, grows a class after RELAY_GROW_AFTER reads in a
+   row filled it, and shrinks one after RELAY_SHRINK_AFTER reads in a row
+   used less than a quarter of it, or after waiting RELAY_IDLE_MS for
+   data. a connection only holds a buffer while there is data to relay.
+   while the memory budget is tight, buffers start at the smallest class
+   and don't grow, and once it is exhausted the connections with the
+   biggest ones pause for RELAY_PAUSE_MS and shrink before every read. */
+#define RELAY_START_CLASS 2
+#define RELAY_GROW_AFTER 2
+#define RELAY_SHRINK_AFTER 8
+#define RELAY_IDLE_MS 1000
+#define RELAY_PAUSE_MS TICK_MS
+
+struct relaybuf {
+	char *buf;
+	unsigned cls, buf_cls, full, small;
+};
+
+static void relaybuf_release(struct relaybuf *rb) {
+	if(!rb->buf) return;
+	bufpool_put(rb->buf, rb->buf_cls);
+	rb->buf = 0;
+}
+
+static void relaybuf_adapt(struct relaybuf *rb, size_t n) {
+	size_t size = bufpool_size(rb->buf_cls);
+	if(n == size) {
+		rb->small = 0;
+		if(++rb->full >= RELAY_GROW_AFTER && rb->cls + 1 < BUFPOOL_CLASSES &&
+		   budget_level() == BUDGET_OK) {
+			rb->cls++;
+			rb->full = 0;
+		}
+	} else if(n < size / 4) {
+		rb->full = 0;
+		if(++rb->small >= RELAY_SHRINK_AFTER && rb->cls > 0) {
+			rb->cls--;
+			rb->small = 0;
+		}
+	} else rb->full = rb->small = 0;
+	if(rb->buf_cls != rb->cls) relaybuf_release(rb);
+}
+
+/* waits until one of the n fds is readable, without a buffer held if
+   that takes a while. */
+static int relay_wait(struct relaybuf *rb, struct pollfd *fds, int n, int timeout) {
+	int ret = poll(fds, n, 0);
+	if(ret) return ret;
+	relaybuf_release(rb);
+	unsigned long long before = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+	/* inactive connections are reaped by the idle timer, which shuts
+	   the sockets down. usually programs send keep-alive packets so
+	   this should only happen when a connection is really unused. */
+	ret = poll(fds, n, timeout);
+	if(atomic_load_explicit(&coarse_now, memory_order_relaxed) - before >= RELAY_IDLE_MS && rb->cls > 0) {
+		rb->cls--;
+		rb->full = rb->small = 0;
+	}
+	return ret;
+}
+
+/* holds off reading while the memory budget is exhausted. the sender
+   runs into the socket's receive buffer meanwhile and has to wait. */
+static void relay_pause(struct relaybuf *rb, struct stats_shard *stats) {
+	relaybuf_release(rb);
+	if(rb->cls > 0) rb->cls--;
+	rb->full = rb->small = 0;
+	stats_add(stats, relay_pauses, 1);
+	poll(0, 0, RELAY_PAUSE_MS);
+}
+
+/* each direction of a relayed connection is classified every
+   FLOW_WINDOW_MS while data flows: one that relayed FLOW_BULK_RATE bytes
+   per second, in reads of FLOW_BULK_READ bytes on average, is bulk, the
+   others are interactive.
+   bulk flows get SO_RCVLOWAT on the socket they are read from, so the
+   thread wakes up for FLOW_RCVLOWAT bytes at a time instead of for every
+   segment, and a relay buffer of at least FLOW_BULK_CLASS. a bulk flow
+   that has less than that pending for FLOW_TAIL_MS is read anyway and
+   counts as interactive again.
+   interactive flows get TCP_NOTSENT_LOWAT on the socket they are written
+   to, so their data waits in the sender's window instead of behind
+   megabytes in our send buffer. */
+#define FLOW_WINDOW_MS 1000
+#define FLOW_BULK_RATE (1024*1024)
+#define FLOW_BULK_READ 8192
+#define FLOW_RCVLOWAT (64*1024)
+#define FLOW_BULK_CLASS 4
+#define FLOW_TAIL_MS 10
+#define FLOW_NOTSENT_LOWAT (16*1024)
+
+struct flow {
+	int infd, outfd, rcvlowat;
+	enum stats_flow cls;
+	/* the current window */
+	unsigned long long since, bytes;
+	unsigned reads;
+};
+
+static void flow_init(struct flow *f, struct thread *t, enum stats_leg from, int infd, int outfd) {
+	*f = (struct flow) {.infd = infd, .outfd = outfd, .rcvlowat = FLOW_RCVLOWAT};
+	/* the watermark must leave room in a fixed receive buffer */
+	if(t->bufsize[from] && f->rcvlowat > t->bufsize[from] / 4)
+		f->rcvlowat = t->bufsize[from] / 4;
+}
+
+static void flow_set(struct flow *f, enum stats_flow cls, struct relaybuf *rb, struct stats_shard *stats) {
+	int val;
+	if(cls == f->cls) return;
+	if(cls == FLOW_BULK || f->cls == FLOW_BULK) {
+		val = cls == FLOW_BULK ? f->rcvlowat : 1;
+		setsockopt(f->infd, SOL_SOCKET, SO_RCVLOWAT, &val, sizeof val);
+	}
+#ifdef TCP_NOTSENT_LOWAT
+	if(cls == FLOW_INTERACTIVE || f->cls == FLOW_INTERACTIVE) {
+		/* 0 goes back to the system default */
+		val = cls == FLOW_INTERACTIVE ? FLOW_NOTSENT_LOWAT : 0;
+		setsockopt(f->outfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val, sizeof val);
+	}
+#endif
+	if(cls == FLOW_BULK && rb->cls < FLOW_BULK_CLASS && budget_level() == BUDGET_OK) {
+		rb->cls = FLOW_BULK_CLASS;
+		rb->full = rb->small = 0;
+	}
+	stats_add(stats, flows[f->cls], -1);
+	stats_add(stats, flows[cls], 1);
+	f->cls = cls;
+}
+
+static void flow_account(struct flow *f, size_t n, unsigned long long now, struct relaybuf *rb, struct stats_shard *stats) {
+	f->bytes += n;
+	f->reads++;
+	if(!f->since) f->since = now;
+	if(now - f->since < FLOW_WINDOW_MS) return;
+	int bulk = f->bytes * 1000 / (now - f->since) >= FLOW_BULK_RATE &&
+		f->bytes / f->reads >= FLOW_BULK_READ;
+	flow_set(f, bulk ? FLOW_BULK : FLOW_INTERACTIVE, rb, stats);
+	f->since = now;
+	f->bytes = f->reads = 0;
+}
+
+/* returns 0 when both sides are done, -1 on error. */
+static int copyloop(struct thread *t, int fd1, int fd2) {
 	struct pollfd fds[2] = {
 		[0] = {.fd = fd1, .events = POLLIN},
 		[1] = {.fd = fd2, .events = POLLIN},
 	};
-	int infd, bidir = 1;
+	int infd = fd1, bidir = 1, ret;
+	struct stats_shard *stats = stats_local();
+	/* relay mode (-C) has no connect request to measure from */
+	int first = t->request_at != 0;
+	struct relaybuf rb = {.cls = budget_level() == BUDGET_OK ? RELAY_START_CLASS : 0};
+	/* used only when the pool is out of memory, untouched otherwise */
+	char spare[4096];
+	/* the directions, by the socket they are read from, as in fds */
+	struct flow flow[2];
+	/* the sends of bulk flows, by the socket they go to, as in fds */
+	struct zerocopy zc[2];
+	int i;
+	flow_init(&flow[0], t, LEG_CLIENT, fd1, fd2);
+	flow_init(&flow[1], t, LEG_UPSTREAM, fd2, fd1);
+	zerocopy_init(&zc[0], fd1, zerocopy);
+	zerocopy_init(&zc[1], fd2, zerocopy);
+	stats_add(stats, flows[FLOW_UNCLASSIFIED], 2);
 
 	while(1) {
-		if(bidir) {
-			/* inactive connections are reaped after 15 min to free resources.
-			   usually programs send keep-alive packets so this should only happen
-			   when a connection is really unused. */
-			switch(poll(fds, 2, 60*15*1000)) {
-				case 0:
-					return;
-				case -1:
-					if(errno == EINTR || errno == EAGAIN) continue;
-					else perror("poll");
-					return;
-			}
-			infd = (fds[0].revents & POLLIN) ? fd1 : fd2;
+		int from = bidir ? 0 : infd == fd2, to = bidir ? 2 : from + 1, timeout = -1;
+		for(i = from; i < to; i++)
+			if(flow[i].cls == FLOW_BULK) timeout = FLOW_TAIL_MS;
+		int ready = relay_wait(&rb, &fds[from], to - from, timeout);
+		if(ready == -1) {
+			if(errno == EINTR || errno == EAGAIN) continue;
+			perror("poll");
+			ret = -1;
+			break;
+		}
+		if(!ready) {
+			/* a bulk flow went quiet, whatever is left of it is read
+			   once the watermark is gone */
+			for(i = from; i < to; i++)
+				if(flow[i].cls == FLOW_BULK) flow_set(&flow[i], FLOW_INTERACTIVE, &rb, stats);
+			continue;
 		}
+		/* zerocopy completions come in as POLLERR. a socket with
+		   nothing else to report has nothing to read either, a real
+		   error shows up with POLLHUP. */
+		int events = 0, zc_only = 0;
+		for(i = from; i < to; i++) {
+			events |= fds[i].revents & (POLLIN | POLLHUP);
+			if(!(fds[i].revents & POLLERR) || !zc[i].count) continue;
+			zerocopy_reap(&zc[i]);
+			if(!(fds[i].revents & ~POLLERR)) zc_only = 1;
+		}
+		if(zc_only && !events) continue;
+		if(bidir) infd = (fds[0].revents & POLLIN) ? fd1 : fd2;
 		int outfd = infd == fd2 ? fd1 : fd2;
-		/* since the biggest stack consumer in the entire code is
-		   libc's getaddrinfo(), we can safely use at least half the
-		   available stacksize to improve throughput. */
-		char buf[MIN(16*1024, THREAD_STACK_SIZE/2)];
-		ssize_t sent = 0, n = read(infd, buf, sizeof buf);
-		if(n < 0) return;
+		if(rb.cls >= atomic_load_explicit(&relay_pause_cls, memory_order_relaxed)) {
+			relay_pause(&rb, stats);
+			continue;
+		}
+		if(!rb.buf) {
+			rb.buf = bufpool_get(rb.cls);
+			rb.buf_cls = rb.cls;
+		}
+		char *buf = rb.buf ? rb.buf : spare;
+		size_t size = rb.buf ? bufpool_size(rb.buf_cls) : sizeof spare;
+		ssize_t sent = 0, n = read(infd, buf, size);
+		if(n < 0) {
+			ret = -1;
+			break;
+		}
 		if(n == 0) {
-			if(!bidir) return;
+			if(!bidir) {
+				ret = 0;
+				break;
+			}
 			shutdown(outfd, SHUT_WR);
-			/* from now on we can skip the poll */
+			/* from now on only the other side is left to wait for */
 			bidir = 0;
 			infd = outfd;
 			continue;
 		}
-		while(sent < n) {
+		struct zerocopy *z = &zc[outfd == fd2];
+		if(rb.buf && flow[infd == fd2].cls == FLOW_BULK && zerocopy_ready(z))
+			sent = zerocopy_send(z, &rb.buf, rb.buf_cls, n) ? 0 : n;
+		else while(sent < n) {
 			ssize_t m = write(outfd, buf+sent, n-sent);
-			if(m < 0) return;
+			if(m < 0) break;
 			sent += m;
 		}
-		atomic_fetch_add_explicit(
-			outfd == fd2? &bytes_out : &bytes_in,
-			n, memory_order_relaxed);
+		if(sent < n) {
+			ret = -1;
+			break;
+		}
+		if(rb.buf) relaybuf_adapt(&rb, n);
+		if(outfd == fd2) {
+			stats_add(stats, bytes_out, n);
+			add_bytes(&t->bytes_out, n);
+		} else {
+			stats_add(stats, bytes_in, n);
+			add_bytes(&t->bytes_in, n);
+			if(first) {
+				stats_time(PHASE_FIRST_BYTE, clock_us() - t->request_at);
+				first = 0;
+			}
+		}
+		if((t->top_pending += n) >= TOP_CHUNK) top_flush(t);
+		unsigned long long now = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+		atomic_store_explicit(&t->last_active, now, memory_order_relaxed);
+		if(trace_log != -1) {
+			/* the coarse clock may lag behind accept by a tick */
+			unsigned long long since = now > t->accepted / 1000 ? now - t->accepted / 1000 : 0;
+			t->trace.bytes[trace_bucket(since)][outfd == fd2 ? TRACE_UP : TRACE_DOWN] += n;
+		}
+		flow_account(&flow[infd == fd2], n, now, &rb, stats);
+		if(now >= t->next_sample) sample_tcp(t, fd1, fd2, now);
+	}
+	relaybuf_release(&rb);
+	for(i = 0; i < 2; i++) {
+		stats_add(stats, flows[flow[i].cls], -1);
+		zerocopy_finish(&zc[i]);
 	}
+	return ret;
 }
 
 static enum errorcode check_credentials(unsigned char* buf, size_t n) {
@@ -336,77 +957,331 @@ static enum errorcode check_credentials(unsigned char* buf, size_t n) {
 	return EC_NOT_ALLOWED;
 }
 
+static void leave_preauth(struct thread *t) {
+	if(t->preauth) {
+		t->preauth = 0;
+		atomic_fetch_sub_explicit(&preauth_count, 1, memory_order_relaxed);
+	}
+}
+
+static void set_state(struct thread *t, enum socksstate state) {
+	stats_dec(states[t->state]);
+	stats_inc(states[state]);
+	t->state = state;
+}
+
+static void send_failure(struct thread *t, enum errorcode ec) {
+	stats_inc(errors[ec]);
+	send_error(t->client.fd, ec);
+}
+
 static int handshake(struct thread *t) {
 	unsigned char buf[1024];
 	ssize_t n;
 	int ret;
 	enum authmethod am;
-	t->state = SS_1_CONNECTED;
+	unsigned long long start;
+	unsigned timeout = atomic_load_explicit(&t->to->handshake, memory_order_relaxed);
+	/* the deadline counts from accept(), so a client that connects and
+	   then stays silent doesn't pin a thread for long. */
+	if(timeout) conn_deadline(t, t->accepted / 1000 + timeout * 1000ULL, -1);
 	while((n = recv(t->client.fd, buf, sizeof buf, 0)) > 0) {
 		switch(t->state) {
 			case SS_1_CONNECTED:
+				stats_time(PHASE_GREETING, clock_us() - t->accepted);
 				am = check_auth_method(buf, n, &t->client);
-				if(am == AM_NO_AUTH) t->state = SS_3_AUTHED;
-				else if (am == AM_USERNAME) t->state = SS_2_NEED_AUTH;
+				if(am == AM_NO_AUTH) {
+					set_state(t, SS_3_AUTHED);
+					set_doing(t, DOING_REQUEST);
+					leave_preauth(t);
+				}
+				else if (am == AM_USERNAME) {
+					set_state(t, SS_2_NEED_AUTH);
+					set_doing(t, DOING_AUTH);
+				}
 				send_auth_response(t->client.fd, 5, am);
-				if(am == AM_INVALID) return -1;
+				if(am == AM_INVALID) {
+					stats_inc(errors[EC_NOT_ALLOWED]);
+					t->acc.reason = CLOSE_AUTH_FAILED;
+					return -1;
+				}
 				break;
 			case SS_2_NEED_AUTH:
+				start = clock_us();
 				ret = check_credentials(buf, n);
 				send_auth_response(t->client.fd, 1, ret);
-				if(ret != EC_SUCCESS)
+				if(ret != EC_SUCCESS) {
+					stats_inc(errors[ret]);
+					t->acc.reason = CLOSE_AUTH_FAILED;
 					return -1;
-				t->state = SS_3_AUTHED;
+				}
+				t->acc.authed = 1;
+				set_state(t, SS_3_AUTHED);
+				set_doing(t, DOING_REQUEST);
+				leave_preauth(t);
 				if(auth_ips && !pthread_rwlock_wrlock(&auth_ips_lock)) {
 					if(!is_in_authed_list(&t->client.addr))
 						add_auth_ip(&t->client.addr);
 					pthread_rwlock_unlock(&auth_ips_lock);
 				}
+				stats_time(PHASE_AUTH, clock_us() - start);
 				break;
 			case SS_3_AUTHED:
-				ret = connect_socks_target(buf, n, &t->client);
+				t->request_at = clock_us();
+				ret = connect_socks_target(buf, n, sizeof buf, t);
 				if(ret < 0) {
-					send_error(t->client.fd, ret*-1);
+					send_failure(t, ret*-1);
+					t->acc.reason = CLOSE_REQUEST_FAILED;
+					t->acc.error = ret*-1;
 					return -1;
 				}
 				send_error(t->client.fd, EC_SUCCESS);
 				return ret;
+			case SS_4_RELAYING:
+				return -1;
 		}
 	}
 	return -1;
 }
 
+static const char *close_names[] = {
+	[CLOSE_EOF] = "eof",
+	[CLOSE_ERROR] = "error",
+	[CLOSE_CLIENT_GONE] = "client_gone",
+	[CLOSE_AUTH_FAILED] = "auth_failed",
+	[CLOSE_REQUEST_FAILED] = "request_failed",
+	[CLOSE_HANDSHAKE_TIMEOUT] = "handshake_timeout",
+	[CLOSE_CONNECT_TIMEOUT] = "connect_timeout",
+	[CLOSE_IDLE_TIMEOUT] = "idle_timeout",
+	[CLOSE_KILLED] = "killed",
+};
+
+/* writes s as a json string to out, which must have room for the
+   worst case of 6 bytes per input byte plus quotes and terminator. */
+static char *json_string(char *out, const char *s) {
+	char *p = out;
+	*p++ = '"';
+	for(; *s; s++) {
+		unsigned char c = *s;
+		if(c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if(c < 0x20 || c >= 0x7f)
+			/* bytes that aren't ascii are taken as latin-1 */
+			p += sprintf(p, "\\u%04x", c);
+		else
+			*p++ = c;
+	}
+	*p++ = '"';
+	*p = 0;
+	return out;
+}
+
+static char *address(char *out, const union sockaddr_union *a) {
+	if(SOCKADDR_UNION_AF(a) == AF_UNSPEC) return strcpy(out, "null");
+	out[0] = '"';
+	inet_ntop(SOCKADDR_UNION_AF(a), SOCKADDR_UNION_ADDRESS(a), out + 1, INET6_ADDRSTRLEN);
+	return strcat(out, "\"");
+}
+
+static char *duration(char *out, long long us) {
+	if(us < 0) return strcpy(out, "null");
+	sprintf(out, "%lld.%03lld", us / 1000, us % 1000);
+	return out;
+}
+
+static size_t format_access(char *out, size_t size, const void *data) {
+	const struct access_record *r = data;
+	char client[INET6_ADDRSTRLEN + 2], target[INET6_ADDRSTRLEN + 2];
+	char user[255 * 6 + 3], host[255 * 6 + 3], when[32], ms[4][24];
+	char cc[LEG_MAX][CONGESTION_NAME * 6 + 3];
+	time_t secs = r->closed_ms / 1000;
+	struct tm tm;
+	strftime(when, sizeof when, "%Y-%m-%dT%H:%M:%S", gmtime_r(&secs, &tm));
+	return snprintf(out, size,
+		"{\"time\":\"%s.%03dZ\",\"client\":%s,\"user\":%s,\"host\":%s,\"port\":%u,"
+		"\"target\":%s,\"bytes_in\":%llu,\"bytes_out\":%llu,\"handshake_ms\":%s,"
+		"\"dns_ms\":%s,\"connect_ms\":%s,\"total_ms\":%s,\"close\":\"%s\",\"error\":%d,"
+		"\"congestion_client\":%s,\"congestion_upstream\":%s}\n",
+		when, (int) (r->closed_ms % 1000), address(client, &r->client),
+		r->authed ? json_string(user, auth_user) : "null",
+		r->host[0] ? json_string(host, r->host) : "null", r->port,
+		address(target, &r->target), r->bytes_in, r->bytes_out,
+		duration(ms[0], r->handshake_us), duration(ms[1], r->dns_us),
+		duration(ms[2], r->connect_us), duration(ms[3], r->total_us),
+		close_names[r->reason], r->error,
+		r->congestion[LEG_CLIENT] ? json_string(cc[LEG_CLIENT], congestion_name(r->congestion[LEG_CLIENT])) : "null",
+		r->congestion[LEG_UPSTREAM] ? json_string(cc[LEG_UPSTREAM], congestion_name(r->congestion[LEG_UPSTREAM])) : "null");
+}
+
+/* a timer that fired is what ended the connection, whatever the relay
+   or handshake made of the shut down socket */
+static void final_reason(struct thread *t) {
+	if(t->killed)
+		t->acc.reason = CLOSE_KILLED;
+	else if(t->expired)
+		t->acc.reason = t->state == SS_4_RELAYING ? CLOSE_IDLE_TIMEOUT :
+		                t->request_at ? CLOSE_CONNECT_TIMEOUT : CLOSE_HANDSHAKE_TIMEOUT;
+}
+
+static void log_access(struct thread *t) {
+	struct access_record *r = &t->acc;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	r->closed_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+	r->client = t->client.addr;
+	r->bytes_in = atomic_load_explicit(&t->bytes_in, memory_order_relaxed);
+	r->bytes_out = atomic_load_explicit(&t->bytes_out, memory_order_relaxed);
+	r->total_us = clock_us() - t->accepted;
+	if(t->request_at) r->handshake_us = t->request_at - t->accepted;
+	log_write(access_log, format_access, r, offsetof(struct access_record, host) + strlen(r->host) + 1);
+}
+
+/* trace records are encoded by the connection thread, the log thread
+   only copies them. */
+static size_t format_trace(char *out, size_t size, const void *data) {
+	const unsigned char *rec = data;
+	size_t len = 2 + (rec[0] | rec[1] << 8);
+	if(len <= size) memcpy(out, rec, len);
+	return len;
+}
+
+static void log_trace(struct thread *t) {
+	struct trace_conn *c = &t->trace;
+	unsigned char rec[TRACE_MAX];
+	c->arrival = t->accepted > trace_started ? t->accepted - trace_started : 0;
+	c->lifetime = clock_us() - t->accepted;
+	c->dest = t->acc.host[0] ? trace_hash(trace_key, t->acc.host, t->acc.port) : 0;
+	if(t->acc.authed) c->flags |= TRACE_PASSWORD;
+	if(t->state == SS_4_RELAYING) c->flags |= TRACE_RELAYED;
+	c->reason = t->acc.reason;
+	log_write(trace_log, format_trace, rec, trace_encode(rec, c));
+}
+
+/* counts a socks client whose SYN carried data that we took (-f). with
+   -C that is the socket accepted on the -C port. */
+static void count_syn_data(int fd) {
+	struct tcpinfo i;
+	if(!tcpinfo_sample(fd, &i) && i.syn_data) stats_inc(fastopen_syn_data[LEG_CLIENT]);
+}
+
 static void* clientthread(void *data) {
 	struct thread *t = data;
 	int remotefd = -1;
+	/* connections wait longest in the kernel's accept queue, which our
+	   clock doesn't see. they have been waiting since the client's last
+	   packet: the handshake, or the request it sent right after. */
+	unsigned long long waited = clock_us() - t->queued;
+	struct tcpinfo ti;
+	if(!tcpinfo_sample(t->client.fd, &ti) && ti.last_recv * 1000ULL > waited)
+		waited = ti.last_recv * 1000ULL;
+	admission_sojourn(waited);
+	/* sockets start out with what their listener, or server_connect(),
+	   gave them */
+	t->bufsize[LEG_CLIENT] = sockbuf_size(leg_kind(LEG_CLIENT), 0);
+	size_socket(t, LEG_CLIENT, t->client.fd, 0);
+	/* a tunnel never speaks first, its SYN can't carry any data */
+	if(fastopen && !client_link && !connector_server) count_syn_data(t->client.fd);
 	if(connector_server) {
 		struct client c2;
+		set_doing(t, DOING_WAITING);
 		if(server_waitclient(connector_server, &c2) == 0) {
 			remotefd = c2.fd;
+			if(fastopen) count_syn_data(remotefd);
+			t->bufsize[LEG_UPSTREAM] = sockbuf_size(SOCKBUF_CLIENT, 0);
+			size_socket(t, LEG_UPSTREAM, remotefd, 0);
 		}
 	} else {
 		remotefd = handshake(t);
+		leave_preauth(t);
 	}
 	if(remotefd != -1) {
-		copyloop(t->client.fd, remotefd);
-		close(remotefd);
+		set_state(t, SS_4_RELAYING);
+		/* what the kernel actually uses, for the admin socket and the
+		   access log */
+		t->acc.congestion[LEG_CLIENT] = congestion_get(t->client.fd);
+		t->acc.congestion[LEG_UPSTREAM] = congestion_get(remotefd);
+		set_doing(t, DOING_RELAYING);
+		atomic_store_explicit(&t->last_active, clock_ms(), memory_order_relaxed);
+		conn_timeout(t, atomic_load_explicit(&t->to->idle, memory_order_relaxed), remotefd);
+		top_connection(t);
+		t->acc.reason = copyloop(t, t->client.fd, remotefd) ? CLOSE_ERROR : CLOSE_EOF;
+		top_flush(t);
 	}
+	/* the timer must be gone, and the admin socket must know, before
+	   the descriptors can be reused */
+	pthread_mutex_lock(&timers_lock);
+	tw_cancel(&timers, &t->timer);
+	t->closed = 1;
+	pthread_mutex_unlock(&timers_lock);
+	if(remotefd != -1) close(remotefd);
 	close(t->client.fd);
+	budget_release(BUDGET_SOCKET, t->sockbuf[LEG_CLIENT] + t->sockbuf[LEG_UPSTREAM]);
+	final_reason(t);
+	if(access_log != -1) log_access(t);
+	if(trace_log != -1) log_trace(t);
+	stats_dec(states[t->state]);
 	t->done = 1;
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load(&accept_paused)) write(wakefds[1], "", 1);
 	return 0;
 }
 
+static void log_latency(const char *when) {
+	char buf[512];
+	size_t i, l = 0;
+	for(i = 0; i < PHASE_MAX; i++) {
+		struct stats_quantiles lat;
+		stats_latency(i, &lat);
+		if(!lat.interval_count) continue;
+		l += snprintf(buf + l, sizeof buf - l, " %s %.1f/%.1f/%.1f",
+			stats_phase_names[i], lat.p50 / 1000.0, lat.p99 / 1000.0, lat.p999 / 1000.0);
+		if(l >= sizeof buf) return;
+	}
+	if(l) dolog("%.24s latency p50/p99/p999 ms:%s\n", when, buf);
+}
+
+static void log_top(const char *when, enum topk_list l, const char *what) {
+	struct topk_entry top[3];
+	char buf[3 * (TOPK_KEY + 32)], name[TOPK_KEY + 1];
+	size_t i, n = topk_get(l, top, 3), len = 0;
+	for(i = 0; i < n; i++)
+		len += snprintf(buf + len, sizeof buf - len, " %s (%llu kbyte)",
+			topk_name(l, &top[i], name, sizeof name), top[i].count / 1024);
+	if(n) dolog("%.24s top %s:%s\n", when, what, buf);
+}
+
 static void* statsthread(void *data) {
+	struct stats_totals prev, cur;
+	unsigned long long prev_ms = clock_ms(), now_ms;
+	(void) data;
+	stats_sum(&prev);
 	for(;;) {
 		time_t t = time(NULL);
-		int bo = atomic_exchange(&bytes_out, 0);
-		int bi = atomic_exchange(&bytes_in, 0);
-		if(bi || bo) {
-			char buf[26];
-			dolog("%.24s in %d (%d kbyte/s) out %d (%d kbyte/s)\n",
-				ctime_r(&t, buf), bi, (bi + 30000) / 60000, bo, (bo + 30000) / 60000);
-		}
 		sleep(60 - t % 60);
+		t = time(NULL);
+		char when[26];
+		ctime_r(&t, when);
+		now_ms = clock_ms();
+		stats_sum(&cur);
+		unsigned long long bi = cur.bytes_in - prev.bytes_in;
+		unsigned long long bo = cur.bytes_out - prev.bytes_out;
+		unsigned long long ms = MAX(now_ms - prev_ms, 1);
+		unsigned long long rj = 0;
+		size_t i;
+		for(i = 0; i < REJECT_MAX; i++) rj += cur.rejects[i] - prev.rejects[i];
+		if(bi || bo || rj)
+			dolog("%.24s in %llu (%llu kbyte/s) out %llu (%llu kbyte/s) rejected %llu"
+				" total in %llu out %llu\n",
+				when, bi, (bi + ms/2) / ms, bo, (bo + ms/2) / ms, rj,
+				cur.bytes_in, cur.bytes_out);
+		stats_interval();
+		topk_interval();
+		log_latency(when);
+		log_top(when, TOP_CLIENT_BYTES, "clients");
+		log_top(when, TOP_DEST_BYTES, "destinations");
+		prev = cur;
+		prev_ms = now_ms;
 	}
 	return 0;
 }
@@ -417,18 +1292,432 @@ static void collect(sblist *threads) {
 		struct thread* thread = *((struct thread**)sblist_get(threads, i));
 		if(thread->done) {
 			pthread_join(thread->pt, 0);
+			if(thread->ip_counted) admission_release(&thread->client.addr);
+			pthread_mutex_lock(&threads_lock);
 			sblist_delete(threads, i);
-			free(thread);
+			pthread_mutex_unlock(&threads_lock);
+			slab_free(&thread_slab, thread);
 		} else
 			i++;
 	}
 }
 
+/* whether the pre-auth limit has no room left, with spare more
+   connections than it allows. */
+static int preauth_full(unsigned spare) {
+	/* in relay mode (-C) there is no handshake at all */
+	unsigned max = atomic_load_explicit(&max_preauth, memory_order_relaxed);
+	return !connector_server && max &&
+		atomic_load_explicit(&preauth_count, memory_order_relaxed) >= max + spare;
+}
+
+static void reject(struct client *c, enum stats_reject why) {
+	close(c->fd);
+	stats_inc(rejects[why]);
+}
+
+/* runs a freshly accepted connection through admission control. if it
+   may proceed, it counts against the per-ip and pre-auth limits until
+   spawn() or drop() is called for it, with what admit() put in
+   *counted. spare is how many pre-auth connections the caller is going
+   to give up for it, if need be. */
+static int admit(sblist *threads, struct client *c, int *counted, unsigned spare) {
+	/* reap finished threads first, so that per-ip connection
+	   counts are up to date when the new client gets checked. */
+	collect(threads);
+	stats_inc(accepts);
+	if(!admission_check(&c->addr, counted)) {
+		reject(c, REJECT_IP_LIMIT);
+		return 0;
+	}
+	int shed = admission_shed();
+	if(shed || preauth_full(spare)) {
+		if(*counted) admission_release(&c->addr);
+		reject(c, shed ? REJECT_SHED : REJECT_PREAUTH);
+		return 0;
+	}
+	if(!connector_server)
+		atomic_fetch_add_explicit(&preauth_count, 1, memory_order_relaxed);
+	stats_inc(states[SS_1_CONNECTED]);
+	return 1;
+}
+
+/* gives up on an admitted connection that will never reach a thread. */
+static void drop(struct client *c, int counted, enum stats_reject why) {
+	if(counted) admission_release(&c->addr);
+	if(!connector_server)
+		atomic_fetch_sub_explicit(&preauth_count, 1, memory_order_relaxed);
+	stats_dec(states[SS_1_CONNECTED]);
+	reject(c, why);
+}
+
+/* hands an admitted connection to a new thread. accepted is when the
+   connection was accepted, queued when it became ready for a worker. */
+static void spawn(sblist *threads, struct client *c, int counted, unsigned long long accepted, unsigned long long queued) {
+	static unsigned long long next_id;
+	struct thread *curr = slab_alloc(&thread_slab);
+	if(!curr) goto oom;
+	curr->id = ++next_id;
+	curr->done = 0;
+	curr->client = *c;
+	curr->accepted = accepted;
+	curr->queued = queued;
+	curr->preauth = !connector_server;
+	curr->ip_counted = counted;
+	curr->state = SS_1_CONNECTED;
+	curr->request_at = 0;
+	curr->top_pending = 0;
+	curr->next_sample = 0;
+	memset(curr->retrans, 0, sizeof curr->retrans);
+	memset(curr->bufsize, 0, sizeof curr->bufsize);
+	memset(curr->sockbuf, 0, sizeof curr->sockbuf);
+	curr->acc = (struct access_record) {
+		.reason = connector_server ? CLOSE_ERROR : CLOSE_CLIENT_GONE,
+		.handshake_us = -1, .dns_us = -1, .connect_us = -1,
+	};
+	curr->to = &socks_timeouts;
+	curr->timer = (struct timer) {.fn = conn_expired};
+	curr->remotefd = -1;
+	curr->expired = curr->connecting = 0;
+	curr->closed = curr->killed = 0;
+	atomic_init(&curr->last_active, 0);
+	atomic_init(&curr->doing, connector_server ? DOING_WAITING : DOING_GREETING);
+	atomic_init(&curr->bytes_in, 0);
+	atomic_init(&curr->bytes_out, 0);
+	if(trace_log != -1) memset(&curr->trace, 0, sizeof curr->trace);
+	pthread_mutex_lock(&threads_lock);
+	int added = sblist_add(threads, &curr);
+	pthread_mutex_unlock(&threads_lock);
+	if(!added) goto oom_free;
+	pthread_attr_t *a = 0, attr;
+	if(pthread_attr_init(&attr) == 0) {
+		a = &attr;
+		pthread_attr_setstacksize(a, THREAD_STACK_SIZE);
+	}
+	int err = pthread_create(&curr->pt, a, clientthread, curr);
+	if(a) pthread_attr_destroy(&attr);
+	if(!err) {
+		admission_success();
+		return;
+	}
+	pthread_mutex_lock(&threads_lock);
+	sblist_delete(threads, sblist_getsize(threads) - 1);
+	pthread_mutex_unlock(&threads_lock);
+oom_free:
+	slab_free(&thread_slab, curr);
+oom:
+	dolog("rejecting connection due to OOM\n");
+	drop(c, counted, REJECT_OOM);
+	/* stop accepting for a while rather than spin at 100% CPU */
+	admission_failure();
+}
+
+/* connections accepted in lazy mode (-d) wait here, costing nothing but
+   their descriptor, until their first bytes arrive. only then a thread
+   is spawned for them. waitfds[0] is the wakeup pipe, waitfds[1] the
+   listener and waitfds[2+i] belongs to waitroom[i]. the handshake
+   deadlines of waiting connections are kept in a wheel of their own,
+   which only the main thread touches. */
+struct waiting {
+	struct client client;
+	int counted;
+	unsigned long long accepted;
+	struct timer timer;
+};
+static struct waiting *waitroom;
+static struct pollfd *waitfds;
+static size_t waitroom_count, waitroom_size;
+static struct timerwheel waitwheel;
+
+static size_t active_count(sblist *threads) {
+	return sblist_getsize(threads) + waitroom_count;
+}
+
+static void waitroom_remove(size_t i) {
+	struct waiting *w = &waitroom[i], *last = &waitroom[--waitroom_count];
+	tw_cancel(&waitwheel, &w->timer);
+	if(w == last) return;
+	/* the timer is linked by address, so it must be re-armed when moved */
+	int armed = tw_armed(&last->timer);
+	unsigned long long expires = last->timer.expires;
+	tw_cancel(&waitwheel, &last->timer);
+	*w = *last;
+	if(armed) tw_arm(&waitwheel, &w->timer, expires);
+	waitfds[2+i] = waitfds[2+waitroom_count];
+}
+
+static void waiting_expired(struct timer *tm) {
+	struct waiting *w = (void*) ((char*) tm - offsetof(struct waiting, timer));
+	drop(&w->client, w->counted, REJECT_TIMEOUT);
+	waitroom_remove(w - waitroom);
+}
+
+static void serve_lazy(struct server *s, sblist *threads) {
+	struct client c;
+	size_t i;
+	int counted;
+	for(;;) {
+		collect(threads);
+		int ms = admission_wait(active_count(threads));
+		if(ms) {
+			/* from now on exiting threads wake us up. check again in
+			   case one exited before it could see the flag. */
+			atomic_store(&accept_paused, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			collect(threads);
+			ms = admission_wait(active_count(threads));
+		}
+		unsigned long long now = clock_us();
+		tw_advance(&waitwheel, now / 1000 / TICK_MS);
+		int timeout = -1;
+		long long ticks = tw_next(&waitwheel);
+		if(ticks >= 0) {
+			long long left = (long long) ((waitwheel.now + ticks) * TICK_MS - now / 1000);
+			timeout = left > 0 ? left : 0;
+		}
+		if(ms > 0 && (timeout < 0 || ms < timeout)) timeout = ms;
+		waitfds[0] = (struct pollfd) {.fd = wakefds[0], .events = POLLIN};
+		waitfds[1] = (struct pollfd) {.fd = ms ? -1 : s->fd, .events = POLLIN};
+		int n = poll(waitfds, 2 + waitroom_count, timeout);
+		atomic_store(&accept_paused, 0);
+		if(n <= 0) continue;
+		if(waitfds[0].revents) {
+			char drain[64];
+			while(read(wakefds[0], drain, sizeof drain) > 0);
+		}
+		now = clock_us();
+		for(i = waitroom_count; i-- > 0;) {
+			if(!waitfds[2+i].revents) continue;
+			/* hangups go to a thread too, which just finds EOF. */
+			struct waiting w = waitroom[i];
+			waitroom_remove(i);
+			spawn(threads, &w.client, w.counted, w.accepted, now);
+		}
+		if(!waitfds[1].revents) continue;
+		if(server_waitclient(s, &c)) {
+			dolog("failed to accept connection\n");
+			admission_failure();
+			continue;
+		}
+		/* a waiter only makes room for a client that gets in, the new
+		   one is counted against the pre-auth limit by now. */
+		if(!admit(threads, &c, &counted, waitroom_count > 0)) continue;
+		if(waitroom_count && (waitroom_count == waitroom_size || preauth_full(1))) {
+			/* make room by giving up on the client that waited longest */
+			size_t oldest = 0;
+			for(i = 1; i < waitroom_count; i++)
+				if(waitroom[i].accepted < waitroom[oldest].accepted) oldest = i;
+			drop(&waitroom[oldest].client, waitroom[oldest].counted, REJECT_WAITROOM);
+			waitroom_remove(oldest);
+		}
+		struct waiting *w = &waitroom[waitroom_count];
+		unsigned timeout_s = atomic_load_explicit(&socks_timeouts.handshake, memory_order_relaxed);
+		w->client = c;
+		w->counted = counted;
+		w->accepted = now;
+		w->timer = (struct timer) {.fn = waiting_expired};
+		if(timeout_s) tw_arm(&waitwheel, &w->timer, (now / 1000 + timeout_s * 1000ULL) / TICK_MS + 1);
+		waitfds[2+waitroom_count] = (struct pollfd) {.fd = c.fd, .events = POLLIN};
+		waitroom_count++;
+	}
+}
+
+/* blocks until admission control allows accepting another connection.
+   meanwhile new clients queue up in the listen backlog. */
+static void wait_for_capacity(sblist *threads) {
+	int ms, logged = 0;
+	for(;;) {
+		atomic_store(&accept_paused, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		collect(threads);
+		if(!(ms = admission_wait(active_count(threads)))) break;
+		if(!logged++ && ms < 0)
+			dolog("pausing accept at %zu connections\n", sblist_getsize(threads));
+		struct pollfd pfd = {.fd = wakefds[0], .events = POLLIN};
+		char drain[64];
+		if(poll(&pfd, 1, ms) == 1)
+			while(read(wakefds[0], drain, sizeof drain) > 0);
+	}
+	atomic_store(&accept_paused, 0);
+}
+
+static const char *doing_names[] = {
+	[DOING_WAITING] = "waiting",
+	[DOING_GREETING] = "greeting",
+	[DOING_AUTH] = "auth",
+	[DOING_REQUEST] = "request",
+	[DOING_RESOLVING] = "resolving",
+	[DOING_CONNECTING] = "connecting",
+	[DOING_RELAYING] = "relaying",
+};
+
+struct conn_info {
+	unsigned long long id, age_ms, bytes_in, bytes_out;
+	enum doing doing;
+	union sockaddr_union client;
+	unsigned short port;
+	unsigned char congestion[LEG_MAX];
+	char host[256];
+};
+
+static void admin_list(int fd, char *args) {
+	struct conn_info *list;
+	size_t i, n = 0;
+	unsigned long long now = clock_us();
+	(void) args;
+	/* copy what we need under the lock and print afterwards, so a slow
+	   reader doesn't hold up the main thread */
+	pthread_mutex_lock(&threads_lock);
+	list = malloc(sblist_getsize(threads_all) * sizeof *list + 1);
+	for(i = 0; list && i < sblist_getsize(threads_all); i++) {
+		struct thread *t = *(struct thread**) sblist_get(threads_all, i);
+		struct conn_info *c = &list[n];
+		if(t->done) continue;
+		c->id = t->id;
+		c->age_ms = (now - t->accepted) / 1000;
+		c->doing = atomic_load_explicit(&t->doing, memory_order_acquire);
+		c->bytes_in = atomic_load_explicit(&t->bytes_in, memory_order_relaxed);
+		c->bytes_out = atomic_load_explicit(&t->bytes_out, memory_order_relaxed);
+		c->client = t->client.addr;
+		c->host[0] = 0;
+		/* the destination is filled in before resolving starts */
+		if(c->doing >= DOING_RESOLVING) {
+			memcpy(c->host, t->acc.host, sizeof c->host);
+			c->port = t->acc.port;
+		}
+		if(c->doing == DOING_RELAYING)
+			memcpy(c->congestion, t->acc.congestion, sizeof c->congestion);
+		else
+			c->congestion[LEG_CLIENT] = 0;
+		n++;
+	}
+	pthread_mutex_unlock(&threads_lock);
+	if(!list) {
+		dprintf(fd, "error: out of memory\n");
+		return;
+	}
+	dprintf(fd, "%-8s %-10s %10s %-39s %12s %12s %-15s %s\n",
+		"id", "doing", "age", "client", "in", "out", "congestion", "destination");
+	for(i = 0; i < n; i++) {
+		struct conn_info *c = &list[i];
+		char client[INET6_ADDRSTRLEN] = "-";
+		int af = SOCKADDR_UNION_AF(&c->client);
+		if(af != AF_UNSPEC) inet_ntop(af, SOCKADDR_UNION_ADDRESS(&c->client), client, sizeof client);
+		char cc[2 * CONGESTION_NAME] = "-";
+		if(c->congestion[LEG_CLIENT])
+			snprintf(cc, sizeof cc, "%s/%s", congestion_name(c->congestion[LEG_CLIENT]),
+				congestion_name(c->congestion[LEG_UPSTREAM]));
+		dprintf(fd, "%-8llu %-10s %8llu.%llu %-39s %12llu %12llu %-15s ", c->id, doing_names[c->doing],
+			c->age_ms / 1000, c->age_ms % 1000 / 100, client, c->bytes_in, c->bytes_out, cc);
+		if(c->host[0]) dprintf(fd, "%s:%u\n", c->host, c->port);
+		else dprintf(fd, "-\n");
+	}
+	free(list);
+}
+
+static void admin_kill(int fd, char *args) {
+	char *end;
+	unsigned long long id = strtoull(args, &end, 10);
+	size_t i;
+	int found = 0;
+	if(end == args || *end) {
+		dprintf(fd, "error: usage: kill id\n");
+		return;
+	}
+	pthread_mutex_lock(&threads_lock);
+	for(i = 0; i < sblist_getsize(threads_all); i++) {
+		struct thread *t = *(struct thread**) sblist_get(threads_all, i);
+		if(t->id != id) continue;
+		/* the same as an expiring timer, except that the client socket
+		   is shut down in the connect phase too */
+		pthread_mutex_lock(&timers_lock);
+		if(!t->closed) {
+			t->killed = t->expired = 1;
+			if(t->remotefd != -1) shutdown(t->remotefd, SHUT_RDWR);
+			shutdown(t->client.fd, SHUT_RDWR);
+			found = 1;
+		}
+		pthread_mutex_unlock(&timers_lock);
+		break;
+	}
+	pthread_mutex_unlock(&threads_lock);
+	if(found) dprintf(fd, "killed %llu\n", id);
+	else dprintf(fd, "error: no connection %llu\n", id);
+}
+
+static void admin_stats(int fd, char *args) {
+	(void) args;
+	metrics_write(fd);
+}
+
+static void admin_set(int fd, char *args) {
+	struct admission_params p;
+	admission_get(&p);
+	/* either a field of p, or one of the atomics */
+	struct {
+		const char *name;
+		unsigned *param;
+		atomic_uint *var;
+	} vars[] = {
+		{"rate", &p.rate, 0}, {"burst", &p.burst, 0}, {"ipmaxconn", &p.ip_maxconn, 0},
+		{"maxconn", &p.maxconn, 0}, {"codeltarget", &p.codel_target, 0},
+		{"codelinterval", &p.codel_interval, 0},
+		{"handshake", 0, &socks_timeouts.handshake},
+		{"connect", 0, &socks_timeouts.connect},
+		{"idle", 0, &socks_timeouts.idle},
+		{"maxpreauth", 0, &max_preauth},
+		{"budget", 0, &budget_mb},
+	};
+	size_t i, nvars = sizeof vars / sizeof vars[0];
+	if(!*args) {
+		for(i = 0; i < nvars; i++)
+			dprintf(fd, "%s %u\n", vars[i].name,
+				vars[i].param ? *vars[i].param : atomic_load(vars[i].var));
+		return;
+	}
+	char *value = args + strcspn(args, " \t"), *end;
+	if(*value) *value++ = 0;
+	value += strspn(value, " \t");
+	unsigned long v = strtoul(value, &end, 10);
+	if(end == value || *end || v > UINT_MAX) {
+		dprintf(fd, "error: usage: set [name value]\n");
+		return;
+	}
+	for(i = 0; i < nvars; i++) {
+		if(strcmp(args, vars[i].name)) continue;
+		if(vars[i].param) {
+			*vars[i].param = v;
+			admission_set(&p);
+			/* a raised maxconn may let a paused accept loop go on */
+			if(atomic_load(&accept_paused)) write(wakefds[1], "", 1);
+			/* tell what took effect, burst may be capped */
+			admission_get(&p);
+			v = *vars[i].param;
+		} else
+			atomic_store(vars[i].var, v);
+		dprintf(fd, "%s %lu\n", args, v);
+		return;
+	}
+	dprintf(fd, "error: unknown setting %s\n", args);
+}
+
+static const struct admin_command admin_commands[] = {
+	{"list", "lists open connections", admin_list},
+	{"kill", "id: closes a connection", admin_kill},
+	{"stats", "prints the metrics", admin_stats},
+	{"set", "[name value]: shows or changes limits and timeouts", admin_set},
+	{0},
+};
+
 static int usage(void) {
 	dprintf(2,
 		"MicroSocks SOCKS5 Server\n"
 		"------------------------\n"
-		"usage: microsocks -1 -q -i listenip -p port -u user -P pass -b bindaddr -w ips -c connectip -C port2\n"
+		"usage: microsocks -1 -q -d -f -Z -i listenip -p port -u user -P pass -b bindaddr -w ips -c connectip -C port2\n"
+		"                  -r rate[,burst] -m maxconn -M maxconn -D target[,interval]\n"
+		"                  -H timeout -n maxpreauth -I idle -T timeout -S [ip:]port\n"
+		"                  -L accesslog -z shmfile -a adminsocket -x tracefile -B megabytes\n"
+		"                  -s [kind=]policy,... -g [kind=]algorithm,...\n"
 		"all arguments are optional.\n"
 		"by default listenip is 0.0.0.0 and port 1080.\n\n"
 		"option -q disables logging.\n"
@@ -446,7 +1735,46 @@ static int usage(void) {
 		"option -c causes microsocks to connect to that ip instead of listening.\n"
 		"option -C causes microsocks act as a (non-socks) data relay between two listening sockets:\n"
 		"when a connection comes in on the -p port, it waits for a connection on the -C port, then relays data between them.\n"
-	);
+		"option -r limits every client ip (ipv6: every /64) to rate new connections\n"
+		" per second, allowing bursts of up to burst connections (default: rate).\n"
+		"option -m limits every client ip (ipv6: every /64) to maxconn concurrent connections.\n"
+		" connections over either limit are closed right after accept.\n"
+		"option -M limits the total number of concurrent connections. when it is\n"
+		" reached, or RLIMIT_NOFILE would be, no new connections are accepted.\n"
+		"option -D enables CoDel load shedding: when new connections had to wait\n"
+		" longer than target ms for a worker during interval ms (default 100),\n"
+		" new connections are rejected until the delay drops again.\n"
+		"option -H closes connections that didn't complete the socks handshake\n"
+		" within timeout seconds after connecting.\n"
+		"option -T gives up on connecting to the requested target after timeout seconds.\n"
+		"option -I closes connections after idle seconds without traffic (default 900, 0: never).\n"
+		"option -n limits the number of connections that haven't authenticated yet.\n"
+		" new connections over the limit are closed right after accept.\n"
+		"option -d defers accepting connections until the client sent data\n"
+		" (TCP_DEFER_ACCEPT), and spawns threads only for clients that did.\n"
+		" until then connections wait in a room of maxpreauth (default %d) entries.\n"
+		"option -f enables tcp fast open: clients may send data in their SYN, and data\n"
+		" a client sends right behind its connect request goes to the target in the SYN.\n"
+		"option -Z sends the data of bulk transfers with MSG_ZEROCOPY, where the kernel\n"
+		" doesn't copy it anyway.\n"
+		"option -S serves prometheus metrics over http on ip (default 127.0.0.1) and port.\n"
+		"option -L appends a json line per closed connection to the file accesslog.\n"
+		"option -z publishes the stats in shmfile (e.g. /dev/shm/microsocks) every second,\n"
+		" for microsocks-top to show.\n"
+		"option -a listens for admin commands on the unix socket adminsocket: list and kill\n"
+		" connections, print stats, change limits and timeouts. send help for details.\n"
+		"option -x records the timing and volume of every connection, with destinations\n"
+		" hashed, in tracefile for microsocks-bench -r to replay.\n"
+		"option -B limits the memory of relay buffers and requested socket buffers\n"
+		" to megabytes. as it runs out, new connections get smaller socket buffers,\n"
+		" relay buffers stop growing and the fastest connections pause reading.\n"
+		"option -s sizes socket buffers by a policy per kind of socket: client, upstream\n"
+		" or link (the reverse tunnel of -c and -C), all of them if kind is left out.\n"
+		" policy is auto (kernel autotuning), a fixed size (suffix k or m, default 4m),\n"
+		" or bdp:rate, the rtt times rate bits per second (suffix k, m or g).\n"
+		" e.g. -s auto,upstream=bdp:100m\n"
+		"option -g sets the tcp congestion control algorithm per kind of socket, as -s.\n"
+		" e.g. -g upstream=bbr. unavailable ones fall back to the system default.\n"	, WAITROOM_DEFAULT);
 	return 1;
 }
 
@@ -462,7 +1790,11 @@ int main(int argc, char** argv) {
 	const char *connectip = NULL;
 	char *p, *q;
 	unsigned port = 1080, connector_port = 0;
-	while((ch = getopt(argc, argv, ":1qb:c:C:i:p:u:P:w:")) != -1) {
+	unsigned ip_rate = 0, ip_burst = 0, ip_maxconn = 0;
+	unsigned maxconn = 0, codel_target = 0, codel_interval = 0;
+	int lazy = 0, fd;
+	const char *metrics_addr = NULL, *admin_path = NULL;
+	while((ch = getopt(argc, argv, ":1qdfZb:c:C:i:p:u:P:w:r:m:M:D:H:n:I:T:S:L:z:a:x:B:s:g:")) != -1) {
 		switch(ch) {
 			case 'w': /* fall-through */
 			case '1':
@@ -485,11 +1817,60 @@ int main(int argc, char** argv) {
 			case 'q':
 				quiet = 1;
 				break;
+			case 'd':
+				lazy = 1;
+				break;
+			case 'f':
+				fastopen = 1;
+				break;
+			case 'Z':
+				zerocopy = 1;
+				break;
+			case 'S':
+				metrics_addr = optarg;
+				break;
+			case 'a':
+				admin_path = optarg;
+				break;
+			case 'L':
+				fd = open(optarg, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+				if(fd == -1) {
+					perror(optarg);
+					return 1;
+				}
+				access_log = log_open(fd);
+				break;
+			case 'x': {
+				unsigned char hdr[TRACE_HEADER];
+				struct timespec now;
+				fd = open(optarg, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+				if(fd == -1) {
+					perror(optarg);
+					return 1;
+				}
+				clock_gettime(CLOCK_REALTIME, &now);
+				trace_header(hdr, now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+				if(write(fd, hdr, sizeof hdr) != sizeof hdr) {
+					perror(optarg);
+					return 1;
+				}
+				trace_started = clock_us();
+				trace_key = trace_salt();
+				trace_log = log_open(fd);
+				break;
+			}
+			case 'z':
+				if(statshm_setup(optarg)) {
+					perror(optarg);
+					return 1;
+				}
+				break;
 			case 'b':
 				resolve_sa(optarg, 0, &bind_addr);
 				break;
 			case 'c':
 				connectip = strdup(optarg);
+				client_link = 1;
 				break;
 			case 'C':
 				connector_port = atoi(optarg);
@@ -508,6 +1889,47 @@ int main(int argc, char** argv) {
 			case 'p':
 				port = atoi(optarg);
 				break;
+			case 'r':
+				ip_rate = atoi(optarg);
+				if((p = strchr(optarg, ','))) ip_burst = atoi(p+1);
+				break;
+			case 'm':
+				ip_maxconn = atoi(optarg);
+				break;
+			case 'M':
+				maxconn = atoi(optarg);
+				break;
+			case 'H':
+				atomic_store(&socks_timeouts.handshake, atoi(optarg));
+				break;
+			case 'T':
+				atomic_store(&socks_timeouts.connect, atoi(optarg));
+				break;
+			case 'I':
+				atomic_store(&socks_timeouts.idle, atoi(optarg));
+				break;
+			case 'n':
+				atomic_store(&max_preauth, atoi(optarg));
+				break;
+			case 'D':
+				codel_target = atoi(optarg);
+				if((p = strchr(optarg, ','))) codel_interval = atoi(p+1);
+				break;
+			case 'B':
+				atomic_store(&budget_mb, atoi(optarg));
+				break;
+			case 's':
+				if(sockbuf_parse(optarg)) {
+					dprintf(2, "error: invalid socket buffer policy %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'g':
+				if(congestion_parse(optarg)) {
+					dprintf(2, "error: invalid congestion control %s\n", optarg);
+					return 1;
+				}
+				break;
 			case ':':
 				dprintf(2, "error: option -%c requires an operand\n", optopt);
 				/* fall through */
@@ -523,66 +1945,110 @@ int main(int argc, char** argv) {
 		dprintf(2, "error: -1/-w options must be used together with user/pass\n");
 		return 1;
 	}
+	if(lazy && (connectip || connector_port)) {
+		/* reverse links stay silent until a request comes in */
+		dprintf(2, "error: -d can't be used together with -c or -C\n");
+		return 1;
+	}
+	congestion_check();
 	signal(SIGPIPE, SIG_IGN);
+	admission_setup(ip_rate, ip_burst, ip_maxconn);
+	admission_limits(maxconn, codel_target, codel_interval);
+	if(pipe(wakefds)) {
+		perror("pipe");
+		return 1;
+	}
+	fcntl(wakefds[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakefds[1], F_SETFL, O_NONBLOCK);
 	struct server s;
-	sblist *threads = sblist_new(sizeof (struct thread*), 8);
-	if(connectip == NULL && server_setup(&s, listenip, port)) {
+	slab_cache_init(&thread_slab, "connections", sizeof (struct thread));
+	/* grown linearly, so in big steps to keep reallocs rare under churn */
+	sblist *threads = sblist_new(sizeof (struct thread*), 1024);
+	/* with -C the listening port takes the tunnel from -c */
+	enum sockbuf_kind listen_kind = connector_port ? SOCKBUF_LINK : SOCKBUF_CLIENT;
+	if(connectip == NULL && server_setup(&s, listenip, port, sockbuf_size(listen_kind, 0))) {
 		perror("server_setup");
 		return 1;
 	}
+	/* accepted sockets inherit it */
+	if(connectip == NULL) congestion_set(s.fd, listen_kind);
+	/* with -C, clients come in on the -C port instead */
+	if(connectip == NULL && !connector_port && fastopen && server_fastopen(&s, FASTOPEN_QLEN))
+		perror("setsockopt TCP_FASTOPEN");
 	server = &s;
+	if(lazy) {
+		waitroom_size = atomic_load(&max_preauth);
+		if(!waitroom_size) waitroom_size = WAITROOM_DEFAULT;
+		waitroom = malloc(waitroom_size * sizeof *waitroom);
+		waitfds = malloc((2 + waitroom_size) * sizeof *waitfds);
+		if(!waitroom || !waitfds) {
+			perror("malloc");
+			return 1;
+		}
+		unsigned defer = atomic_load(&socks_timeouts.handshake);
+		if(server_defer_accept(&s, defer ? defer : 30))
+			perror("setsockopt TCP_DEFER_ACCEPT");
+	}
 	struct server connector_s;
 	if(connector_port) {
-		if(server_setup(&connector_s, listenip, connector_port)) {
+		if(server_setup(&connector_s, listenip, connector_port, sockbuf_size(SOCKBUF_CLIENT, 0))) {
 			perror("connector_server_setup");
 			return 1;
 		}
+		congestion_set(connector_s.fd, SOCKBUF_CLIENT);
+		if(fastopen && server_fastopen(&connector_s, FASTOPEN_QLEN))
+			perror("setsockopt TCP_FASTOPEN");
 		connector_server = &connector_s;
 	}
-	pthread_t stats;
+	if((!quiet || access_log != -1 || trace_log != -1) && log_setup()) {
+		perror("log_setup");
+		return 1;
+	}
+	pthread_t stats, timer;
 	pthread_create(&stats, NULL, statsthread, NULL);
+	atomic_store(&coarse_now, clock_ms());
+	tw_init(&timers, clock_ms() / TICK_MS);
+	tw_init(&waitwheel, clock_ms() / TICK_MS);
+	pthread_create(&timer, NULL, timerthread, NULL);
+	if(metrics_addr && metrics_setup(metrics_addr)) {
+		perror("metrics_setup");
+		return 1;
+	}
+	threads_all = threads;
+	if(admin_path && admin_setup(admin_path, admin_commands)) {
+		perror(admin_path);
+		return 1;
+	}
 
+	if(waitroom_size) serve_lazy(&s, threads);
 	while(1) {
-		collect(threads);
 		struct client c;
-		struct thread *curr = malloc(sizeof (struct thread));
-		if(!curr) goto oom;
-		curr->done = 0;
+		int counted;
+		wait_for_capacity(threads);
 		if(connectip) {
+			/* there's no meaningful peer address for the reverse link,
+			   so leave it AF_UNSPEC which admission control ignores. */
+			memset(&c.addr, 0, sizeof c.addr);
 			int sleeptime = 1;
 			for(;;) {
-				c.fd = server_connect(connectip, port);
+				c.fd = server_connect(connectip, port, sockbuf_size(SOCKBUF_LINK, 0));
 				if(c.fd >= 0) break;
 				sleep(sleeptime);
 				sleeptime = MIN(sleeptime * 2, 60);
 			}
+			congestion_set(c.fd, SOCKBUF_LINK);
 			/* wait for request to come in */
 			struct pollfd pfd = {.fd = c.fd, .events = POLLIN};
 			poll(&pfd, 1, -1);
 		} else {
 			if(server_waitclient(&s, &c)) {
+				/* most likely EMFILE or ENOBUFS, back off rather than spin */
 				dolog("failed to accept connection\n");
-				free(curr);
-				usleep(FAILURE_TIMEOUT);
+				admission_failure();
 				continue;
 			}
 		}
-		curr->client = c;
-		if(!sblist_add(threads, &curr)) {
-			close(curr->client.fd);
-			free(curr);
-			oom:
-			dolog("rejecting connection due to OOM\n");
-			usleep(FAILURE_TIMEOUT); /* prevent 100% CPU usage in OOM situation */
-			continue;
-		}
-		pthread_attr_t *a = 0, attr;
-		if(pthread_attr_init(&attr) == 0) {
-			a = &attr;
-			pthread_attr_setstacksize(a, THREAD_STACK_SIZE);
-		}
-		if(pthread_create(&curr->pt, a, clientthread, curr) != 0)
-			dolog("pthread_create failed. OOM?\n");
-		if(a) pthread_attr_destroy(&attr);
+		unsigned long long now = clock_us();
+		if(admit(threads, &c, &counted, 0)) spawn(threads, &c, counted, now, now);
 	}
 }
@@ -0,0 +1,166 @@
+#include "stats.h"
+#include <pthread.h>
+#include <string.h>
+
+struct stats_shard stats_shards[STATS_SHARDS];
+_Thread_local struct stats_shard *stats_mine;
+static atomic_uint next_shard;
+
+struct stats_shard *stats_assign(void) {
+	unsigned i = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed);
+	return &stats_shards[i % STATS_SHARDS];
+}
+
+#define LOAD(X) atomic_load_explicit(&(X), memory_order_relaxed)
+
+void stats_sum(struct stats_totals *out) {
+	size_t i, j;
+	memset(out, 0, sizeof *out);
+	for(i = 0; i < STATS_SHARDS; i++) {
+		struct stats_shard *sh = &stats_shards[i];
+#define X(F) out->F += LOAD(sh->F);
+#define XA(F, N) for(j = 0; j < N; j++) out->F[j] += LOAD(sh->F[j]);
+		STATS_FIELDS
+#undef X
+#undef XA
+	}
+}
+
+const char *stats_state_names[STATS_STATES] = {
+	"connected", "need_auth", "authed", "relaying",
+};
+const char *stats_error_names[STATS_ERRORS] = {
+	"success", "general_failure", "not_allowed", "net_unreachable",
+	"host_unreachable", "conn_refused", "ttl_expired",
+	"command_not_supported", "addresstype_not_supported",
+};
+const char *stats_reject_names[REJECT_MAX] = {
+	[REJECT_IP_LIMIT] = "ip_limit",
+	[REJECT_SHED] = "shed",
+	[REJECT_PREAUTH] = "preauth_limit",
+	[REJECT_WAITROOM] = "waitroom_full",
+	[REJECT_TIMEOUT] = "handshake_timeout",
+	[REJECT_OOM] = "oom",
+};
+
+const char *stats_flow_names[FLOW_CLASSES] = {
+	[FLOW_UNCLASSIFIED] = "unclassified",
+	[FLOW_INTERACTIVE] = "interactive",
+	[FLOW_BULK] = "bulk",
+};
+
+const char *stats_phase_names[PHASE_MAX] = {
+	[PHASE_GREETING] = "greeting",
+	[PHASE_AUTH] = "auth",
+	[PHASE_DNS] = "dns",
+	[PHASE_CONNECT] = "connect",
+	[PHASE_FIRST_BYTE] = "first_byte",
+};
+
+const char *stats_leg_names[LEG_MAX] = {
+	[LEG_CLIENT] = "client",
+	[LEG_UPSTREAM] = "upstream",
+};
+
+const char *stats_tcp_names[TCP_MAX] = {
+	[TCP_RTT] = "rtt",
+	[TCP_RTTVAR] = "rttvar",
+	[TCP_CWND] = "cwnd",
+	[TCP_DELIVERY_RATE] = "delivery_rate",
+	[TCP_NOTSENT] = "notsent",
+};
+
+struct stats_hist stats_tcp_hist[LEG_MAX][TCP_MAX];
+
+/* merged histograms as of the last stats_interval() call, and the
+   percentiles computed from the difference to the one before. */
+static unsigned long long hist_base[PHASE_MAX][HIST_BUCKETS];
+static unsigned long long tcp_base[LEG_MAX][TCP_MAX][HIST_BUCKETS];
+static struct stats_quantiles latency[PHASE_MAX], tcp[LEG_MAX][TCP_MAX];
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the middle of the bucket, which is what any value in it is reported as. */
+static unsigned long long bucket_value(unsigned b) {
+	if(b < HIST_SUB) return b;
+	unsigned e = b / HIST_SUB + HIST_SUB_BITS - 1;
+	unsigned long long lo = (unsigned long long) (HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+	return lo + (1ULL << (e - HIST_SUB_BITS)) / 2;
+}
+
+static unsigned long long percentile(unsigned long long *counts, unsigned long long total, unsigned permille) {
+	unsigned long long rank = (total * permille + 999) / 1000, seen = 0;
+	unsigned b;
+	if(!total) return 0;
+	for(b = 0; b < HIST_BUCKETS; b++) {
+		seen += counts[b];
+		if(seen >= rank) return bucket_value(b);
+	}
+	return bucket_value(HIST_BUCKETS - 1);
+}
+
+/* computes the percentiles of what was added since base, which then
+   moves on to cur. */
+static void close_interval(const unsigned long long *cur, unsigned long long *base, struct stats_quantiles *out) {
+	static unsigned long long delta[HIST_BUCKETS];
+	unsigned long long n = 0;
+	size_t b;
+	for(b = 0; b < HIST_BUCKETS; b++) {
+		delta[b] = cur[b] - base[b];
+		n += delta[b];
+	}
+	struct stats_quantiles q = {
+		.p50 = percentile(delta, n, 500),
+		.p90 = percentile(delta, n, 900),
+		.p99 = percentile(delta, n, 990),
+		.p999 = percentile(delta, n, 999),
+		.interval_count = n,
+	};
+	memcpy(base, cur, sizeof delta);
+	pthread_mutex_lock(&latency_lock);
+	*out = q;
+	pthread_mutex_unlock(&latency_lock);
+}
+
+void stats_interval(void) {
+	static unsigned long long cur[HIST_BUCKETS];
+	size_t ph, i, b, leg;
+	for(ph = 0; ph < PHASE_MAX; ph++) {
+		memset(cur, 0, sizeof cur);
+		for(i = 0; i < STATS_SHARDS; i++)
+			for(b = 0; b < HIST_BUCKETS; b++)
+				cur[b] += LOAD(stats_shards[i].hist[ph].counts[b]);
+		close_interval(cur, hist_base[ph], &latency[ph]);
+	}
+	for(leg = 0; leg < LEG_MAX; leg++)
+		for(i = 0; i < TCP_MAX; i++) {
+			for(b = 0; b < HIST_BUCKETS; b++)
+				cur[b] = LOAD(stats_tcp_hist[leg][i].counts[b]);
+			close_interval(cur, tcp_base[leg][i], &tcp[leg][i]);
+		}
+}
+
+static void totals(struct stats_hist *h, struct stats_quantiles *out) {
+	size_t b;
+	out->sum += LOAD(h->sum);
+	for(b = 0; b < HIST_BUCKETS; b++)
+		out->count += LOAD(h->counts[b]);
+}
+
+void stats_latency(enum stats_phase ph, struct stats_quantiles *out) {
+	size_t i;
+	pthread_mutex_lock(&latency_lock);
+	*out = latency[ph];
+	pthread_mutex_unlock(&latency_lock);
+	/* the cumulative figures needn't wait for the interval to close. */
+	out->count = out->sum = 0;
+	for(i = 0; i < STATS_SHARDS; i++)
+		totals(&stats_shards[i].hist[ph], out);
+}
+
+void stats_tcp_quantiles(enum stats_leg leg, enum stats_tcp m, struct stats_quantiles *out) {
+	pthread_mutex_lock(&latency_lock);
+	*out = tcp[leg][m];
+	pthread_mutex_unlock(&latency_lock);
+	out->count = out->sum = 0;
+	totals(&stats_tcp_hist[leg][m], out);
+}
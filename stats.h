@@ -0,0 +1,171 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+
+#pragma RcB2 DEP "stats.c"
+
+/* traffic counters, sharded so that relay threads don't fight over a
+   single cacheline. every thread picks a shard on first use and keeps
+   adding to it; only readers walk all shards and sum them up.
+   counters are cumulative and 64 bit wide, readers compute rates from
+   the difference between two snapshots. */
+
+#ifndef STATS_SHARDS
+#define STATS_SHARDS 16
+#endif
+
+/* indices into states[] and errors[] are enum socksstate and
+   enum errorcode from sockssrv.c. */
+#define STATS_STATES 4
+#define STATS_ERRORS 9
+
+enum stats_reject {
+	REJECT_IP_LIMIT,
+	REJECT_SHED,
+	REJECT_PREAUTH,
+	REJECT_WAITROOM,
+	REJECT_TIMEOUT,
+	REJECT_OOM,
+	REJECT_MAX
+};
+
+/* the directions of relayed connections, by how copyloop() classified
+   them. a gauge, like states[]. */
+enum stats_flow {
+	FLOW_UNCLASSIFIED,
+	FLOW_INTERACTIVE,
+	FLOW_BULK,
+	FLOW_CLASSES
+};
+
+/* names for the indices of the arrays in struct stats_totals */
+extern const char *stats_state_names[STATS_STATES];
+extern const char *stats_error_names[STATS_ERRORS];
+extern const char *stats_reject_names[REJECT_MAX];
+extern const char *stats_flow_names[FLOW_CLASSES];
+
+/* states[] are gauges: a connection is added to its state by whichever
+   thread moves it there and subtracted by whichever moves it on, so
+   single shards may wrap around, only the sum is meaningful. */
+#define STATS_FIELDS \
+	X(bytes_in) X(bytes_out) X(accepts) \
+	XA(rejects, REJECT_MAX) XA(errors, STATS_ERRORS) XA(states, STATS_STATES) \
+	XA(retransmits, LEG_MAX) X(relay_pauses) XA(flows, FLOW_CLASSES) \
+	X(fastopen_tries) XA(fastopen_syn_data, LEG_MAX) X(zerocopy_sent) X(zerocopy_copied)
+
+/* the two sockets of a relayed connection */
+enum stats_leg {
+	LEG_CLIENT,
+	LEG_UPSTREAM,
+	LEG_MAX
+};
+extern const char *stats_leg_names[LEG_MAX];
+
+/* latency histograms are log-linear like HdrHistogram: values below
+   HIST_SUB microseconds get a bucket each, above that every power of two
+   is split into HIST_SUB buckets, which bounds the relative error to
+   1/HIST_SUB. values of 2^HIST_MAX_BITS us (~71 min) and up share the
+   last bucket. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 32
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum stats_phase {
+	PHASE_GREETING,   /* accept() until the socks greeting arrived */
+	PHASE_AUTH,       /* verifying username and password */
+	PHASE_DNS,        /* resolving the requested host */
+	PHASE_CONNECT,    /* connect() to the target */
+	PHASE_FIRST_BYTE, /* connect request until the first byte from the target */
+	PHASE_MAX
+};
+extern const char *stats_phase_names[PHASE_MAX];
+
+struct stats_hist {
+	atomic_ullong sum, counts[HIST_BUCKETS];
+};
+
+/* TCP_INFO samples of relayed connections, by leg. they are rate
+   limited, so unlike the phase histograms these aren't sharded. */
+enum stats_tcp {
+	TCP_RTT,           /* microseconds */
+	TCP_RTTVAR,        /* microseconds */
+	TCP_CWND,          /* segments */
+	TCP_DELIVERY_RATE, /* bytes per second */
+	TCP_NOTSENT,       /* bytes */
+	TCP_MAX
+};
+extern const char *stats_tcp_names[TCP_MAX];
+extern struct stats_hist stats_tcp_hist[LEG_MAX][TCP_MAX];
+
+#define X(F) atomic_ullong F;
+#define XA(F, N) atomic_ullong F[N];
+struct stats_shard {
+	_Alignas(64) STATS_FIELDS
+	struct stats_hist hist[PHASE_MAX];
+};
+#undef X
+#undef XA
+
+#define X(F) unsigned long long F;
+#define XA(F, N) unsigned long long F[N];
+struct stats_totals {
+	STATS_FIELDS
+};
+#undef X
+#undef XA
+
+extern struct stats_shard stats_shards[STATS_SHARDS];
+extern _Thread_local struct stats_shard *stats_mine;
+
+struct stats_shard *stats_assign(void);
+
+static inline struct stats_shard *stats_local(void) {
+	if(!stats_mine) stats_mine = stats_assign();
+	return stats_mine;
+}
+
+#define stats_add(SHARD, FIELD, N) \
+	atomic_fetch_add_explicit(&(SHARD)->FIELD, (N), memory_order_relaxed)
+#define stats_inc(FIELD) stats_add(stats_local(), FIELD, 1)
+#define stats_dec(FIELD) atomic_fetch_sub_explicit(&stats_local()->FIELD, 1, memory_order_relaxed)
+
+void stats_sum(struct stats_totals *out);
+
+static inline unsigned hist_bucket(unsigned long long v) {
+	if(v < HIST_SUB) return v;
+	unsigned e = 63 - __builtin_clzll(v);
+	if(e >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_add(struct stats_hist *h, unsigned long long v) {
+	atomic_fetch_add_explicit(&h->counts[hist_bucket(v)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+}
+
+/* records a duration in microseconds into the calling thread's shard. */
+static inline void stats_time(enum stats_phase ph, unsigned long long us) {
+	hist_add(&stats_local()->hist[ph], us);
+}
+
+static inline void stats_tcp(enum stats_leg leg, enum stats_tcp m, unsigned long long v) {
+	hist_add(&stats_tcp_hist[leg][m], v);
+}
+
+/* percentiles of the last complete interval, in microseconds for the
+   phases. */
+struct stats_quantiles {
+	unsigned long long p50, p90, p99, p999;
+	/* samples in the last closed interval, and count and sum of all so far */
+	unsigned long long interval_count, count, sum;
+};
+
+/* closes the current interval: the percentiles reported from now on are
+   those of the samples recorded since the previous call. */
+void stats_interval(void);
+void stats_latency(enum stats_phase ph, struct stats_quantiles *out);
+void stats_tcp_quantiles(enum stats_leg leg, enum stats_tcp m, struct stats_quantiles *out);
+
+#endif
@@ -0,0 +1,65 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "statshm.h"
+#include "log.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct statshm *shm;
+
+static uint64_t wallclock_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int statshm_setup(const char *path) {
+	int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if(fd == -1) return -1;
+	if(ftruncate(fd, sizeof *shm)) goto fail;
+	void *p = mmap(0, sizeof *shm, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED) goto fail;
+	close(fd);
+	shm = p;
+	memset(shm, 0, sizeof *shm);
+	shm->version = STATSHM_VERSION;
+	shm->size = sizeof *shm;
+	shm->pid = getpid();
+	shm->started = wallclock_ms();
+	/* readers check the magic last, so it goes in once the rest is valid */
+	atomic_thread_fence(memory_order_release);
+	shm->magic = STATSHM_MAGIC;
+	return 0;
+fail:
+	close(fd);
+	return -1;
+}
+
+void statshm_publish(void) {
+	struct stats_totals t;
+	struct stats_quantiles lat[PHASE_MAX];
+	size_t i, j;
+	if(!shm) return;
+	stats_sum(&t);
+	for(i = 0; i < PHASE_MAX; i++) stats_latency(i, &lat[i]);
+	uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+	atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	shm->updated = wallclock_ms();
+#define X(F) shm->F = t.F;
+#define XA(F, N) for(j = 0; j < N; j++) shm->F[j] = t.F[j];
+	STATS_FIELDS
+#undef X
+#undef XA
+	shm->log_dropped = log_dropped();
+	for(i = 0; i < PHASE_MAX; i++)
+		shm->phases[i] = (struct statshm_phase) {
+			.p50 = lat[i].p50, .p90 = lat[i].p90,
+			.p99 = lat[i].p99, .p999 = lat[i].p999,
+			.count = lat[i].count, .sum = lat[i].sum,
+		};
+	atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
@@ -0,0 +1,50 @@
+#ifndef STATSHM_H
+#define STATSHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "stats.h"
+
+#pragma RcB2 DEP "statshm.c"
+
+/* the counters, published into a shared memory file (usually under
+   /dev/shm) for tools like microsocks-top to read without talking to
+   the process. the layout below is fixed for a given version; anything
+   that changes it, including new STATS_FIELDS, must bump
+   STATSHM_VERSION.
+
+   updates are protected by a seqlock: the writer makes seq odd, writes,
+   and makes it even again. readers copy the segment and retry if seq
+   was odd or changed meanwhile. */
+
+#define STATSHM_MAGIC 0x6d736f63 /* "msoc" */
+#define STATSHM_VERSION 6
+
+struct statshm_phase {
+	/* microseconds, over the previous stats interval */
+	uint64_t p50, p90, p99, p999;
+	/* all samples so far */
+	uint64_t count, sum;
+};
+
+#define X(F) uint64_t F;
+#define XA(F, N) uint64_t F[N];
+struct statshm {
+	uint32_t magic, version, size, pid;
+	atomic_uint_least32_t seq;
+	uint32_t pad;
+	/* wall clock, in ms since the epoch */
+	uint64_t started, updated;
+	STATS_FIELDS
+	uint64_t log_dropped;
+	struct statshm_phase phases[PHASE_MAX];
+};
+#undef X
+#undef XA
+
+/* create the file at path and map it. returns 0 on success. */
+int statshm_setup(const char *path);
+/* copy the current counters into the segment, if set up. */
+void statshm_publish(void);
+
+#endif
@@ -0,0 +1,44 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "tcpinfo.h"
+
+#ifdef __linux__
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+/* the uapi header rather than netinet/tcp.h, whose struct tcp_info stops
+   short of notsent_bytes and delivery_rate on glibc. */
+#include <linux/tcp.h>
+
+#define HAVE(F) (len >= offsetof(struct tcp_info, F) + sizeof i.F)
+
+int tcpinfo_sample(int fd, struct tcpinfo *out) {
+	struct tcp_info i;
+	socklen_t len = sizeof i;
+	if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &i, &len)) return -1;
+	if(!HAVE(tcpi_total_retrans)) return -1;
+	out->rtt = i.tcpi_rtt;
+	out->rttvar = i.tcpi_rttvar;
+	out->cwnd = i.tcpi_snd_cwnd;
+	out->total_retrans = i.tcpi_total_retrans;
+	out->last_recv = i.tcpi_last_ack_recv;
+	out->have_notsent = HAVE(tcpi_notsent_bytes);
+	out->notsent = out->have_notsent ? i.tcpi_notsent_bytes : 0;
+	out->have_delivery_rate = HAVE(tcpi_delivery_rate);
+	out->delivery_rate = out->have_delivery_rate ? i.tcpi_delivery_rate : 0;
+#ifdef TCPI_OPT_SYN_DATA
+	out->syn_data = !!(i.tcpi_options & TCPI_OPT_SYN_DATA);
+#else
+	out->syn_data = 0;
+#endif
+	return 0;
+}
+
+#else
+
+int tcpinfo_sample(int fd, struct tcpinfo *out) {
+	(void) fd; (void) out;
+	return -1;
+}
+
+#endif
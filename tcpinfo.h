@@ -0,0 +1,25 @@
+#ifndef TCPINFO_H
+#define TCPINFO_H
+
+#pragma RcB2 DEP "tcpinfo.c"
+
+/* what the kernel knows about a tcp connection, via TCP_INFO. only
+   available on linux; elsewhere tcpinfo_sample() always fails. */
+struct tcpinfo {
+	unsigned rtt, rttvar;   /* microseconds */
+	unsigned cwnd;          /* segments */
+	unsigned total_retrans; /* segments, over the connection's lifetime */
+	/* these need linux 4.6 and 4.9 respectively, have_... tell whether
+	   the kernel filled them in. */
+	unsigned notsent;       /* bytes */
+	unsigned long long delivery_rate; /* bytes per second */
+	int have_notsent, have_delivery_rate;
+	/* the SYN carried data, sent or received, and the peer took it */
+	int syn_data;
+	unsigned last_recv;     /* milliseconds since the peer's last packet */
+};
+
+/* returns 0 on success. */
+int tcpinfo_sample(int fd, struct tcpinfo *out);
+
+#endif
@@ -0,0 +1,89 @@
+#include "timerwheel.h"
+#include <string.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+
+void tw_init(struct timerwheel *tw, unsigned long long now) {
+	memset(tw, 0, sizeof *tw);
+	tw->now = now;
+}
+
+static void link_timer(struct timerwheel *tw, struct timer *t) {
+	unsigned long long delta = t->expires > tw->now ? t->expires - tw->now : 0;
+	unsigned level = 0;
+	if(!delta) t->expires = tw->now;
+	while(level < TW_LEVELS - 1 && delta >= 1ULL << (TW_BITS * (level + 1)))
+		level++;
+	if(delta >= 1ULL << (TW_BITS * TW_LEVELS))
+		t->expires = tw->now + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+	struct timer **slot = &tw->slots[level][(t->expires >> (TW_BITS * level)) & TW_MASK];
+	t->next = *slot;
+	if(t->next) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void unlink_timer(struct timer *t) {
+	*t->pprev = t->next;
+	if(t->next) t->next->pprev = t->pprev;
+	t->next = 0;
+	t->pprev = 0;
+}
+
+void tw_arm(struct timerwheel *tw, struct timer *t, unsigned long long expires) {
+	if(tw_armed(t)) unlink_timer(t);
+	else tw->count++;
+	t->expires = expires;
+	link_timer(tw, t);
+}
+
+void tw_cancel(struct timerwheel *tw, struct timer *t) {
+	if(!tw_armed(t)) return;
+	unlink_timer(t);
+	tw->count--;
+}
+
+/* moves the timers of the current slot on the given level one level down. */
+static void cascade(struct timerwheel *tw, unsigned level) {
+	struct timer **slot = &tw->slots[level][(tw->now >> (TW_BITS * level)) & TW_MASK];
+	struct timer *t = *slot, *next;
+	*slot = 0;
+	for(; t; t = next) {
+		next = t->next;
+		link_timer(tw, t);
+	}
+}
+
+void tw_advance(struct timerwheel *tw, unsigned long long now) {
+	while(tw->now <= now) {
+		unsigned idx = tw->now & TW_MASK, level;
+		if(!tw->count) {
+			tw->now = now + 1;
+			break;
+		}
+		for(level = 1; !idx && level < TW_LEVELS; level++) {
+			cascade(tw, level);
+			idx = (tw->now >> (TW_BITS * level)) & TW_MASK;
+		}
+		idx = tw->now & TW_MASK;
+		struct timer *t;
+		while((t = tw->slots[0][idx])) {
+			unlink_timer(t);
+			tw->count--;
+			t->fn(t);
+		}
+		tw->now++;
+	}
+}
+
+long long tw_next(struct timerwheel *tw) {
+	unsigned i;
+	if(!tw->count) return -1;
+	for(i = 0; i < TW_SLOTS; i++) {
+		unsigned idx = (tw->now + i) & TW_MASK;
+		if(tw->slots[0][idx]) return i;
+		/* past this point, timers from higher levels may cascade in */
+		if(i && !idx) break;
+	}
+	return i;
+}
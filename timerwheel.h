@@ -0,0 +1,47 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+
+#pragma RcB2 DEP "timerwheel.c"
+
+/* hierarchical timer wheel. arming and cancelling a timer is O(1), and
+   advancing the wheel costs O(1) per tick plus the expired timers.
+
+   time is measured in ticks of the caller's choosing. there are
+   TW_LEVELS levels of TW_SLOTS slots each, so timers can be up to
+   TW_SLOTS^TW_LEVELS ticks in the future; later ones are clamped.
+
+   the wheel does no locking of its own: a wheel shared between threads
+   must be protected by the caller, and callbacks run with that lock held.
+   a callback may re-arm its own timer. */
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+
+struct timer {
+	struct timer *next, **pprev;
+	unsigned long long expires;
+	void (*fn)(struct timer *t);
+};
+
+struct timerwheel {
+	unsigned long long now;
+	size_t count;
+	struct timer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+void tw_init(struct timerwheel *tw, unsigned long long now);
+/* (re)arms t to fire once the wheel is advanced to tick `expires`. */
+void tw_arm(struct timerwheel *tw, struct timer *t, unsigned long long expires);
+/* disarms t. safe to call on a timer that isn't armed. */
+void tw_cancel(struct timerwheel *tw, struct timer *t);
+#define tw_armed(T) ((T)->pprev != 0)
+/* runs the callbacks of all timers expiring up to and including tick now. */
+void tw_advance(struct timerwheel *tw, unsigned long long now);
+/* returns the number of ticks the wheel can sleep without missing a
+   timer, or -1 if none is armed. */
+long long tw_next(struct timerwheel *tw);
+
+#endif
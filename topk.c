@@ -0,0 +1,103 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "topk.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct summary {
+	size_t used;
+	unsigned long long hash[TOPK_SIZE];
+	struct topk_entry e[TOPK_SIZE];
+};
+
+/* the summaries being filled, and those published by topk_interval(). a
+   lock per list is fine: the lists are fed once per connection and once
+   per megabyte relayed, and an update is a scan of TOPK_SIZE hashes. */
+static struct summary live[TOP_MAX], published[TOP_MAX];
+static pthread_mutex_t locks[TOP_MAX] = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_mutex_t published_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long hash(const unsigned char *p, size_t len) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	while(len--) h = (h ^ *p++) * 0x100000001b3ULL;
+	return h;
+}
+
+void topk_add(enum topk_list l, const void *key, size_t len, unsigned long long weight) {
+	struct summary *s = &live[l];
+	size_t i, min = 0;
+	if(len > TOPK_KEY) len = TOPK_KEY;
+	unsigned long long h = hash(key, len);
+	pthread_mutex_lock(&locks[l]);
+	for(i = 0; i < s->used; i++) {
+		struct topk_entry *e = &s->e[i];
+		if(s->hash[i] == h && e->len == len && !memcmp(e->key, key, len)) {
+			e->count += weight;
+			goto out;
+		}
+		if(e->count < s->e[min].count) min = i;
+	}
+	/* a new key takes a free counter, or replaces the smallest one and
+	   inherits its count as the possible overestimate. */
+	struct topk_entry *e;
+	if(s->used < TOPK_SIZE) {
+		e = &s->e[s->used];
+		s->hash[s->used++] = h;
+		e->count = e->error = 0;
+	} else {
+		e = &s->e[min];
+		s->hash[min] = h;
+		e->error = e->count;
+	}
+	e->count += weight;
+	e->len = len;
+	memcpy(e->key, key, len);
+out:
+	pthread_mutex_unlock(&locks[l]);
+}
+
+void topk_interval(void) {
+	size_t l;
+	for(l = 0; l < TOP_MAX; l++) {
+		pthread_mutex_lock(&locks[l]);
+		pthread_mutex_lock(&published_lock);
+		published[l] = live[l];
+		pthread_mutex_unlock(&published_lock);
+		live[l].used = 0;
+		pthread_mutex_unlock(&locks[l]);
+	}
+}
+
+char *topk_name(enum topk_list l, const struct topk_entry *e, char *buf, size_t size) {
+	if(l == TOP_CLIENT_CONNS || l == TOP_CLIENT_BYTES) {
+		if(inet_ntop(e->len == 4 ? AF_INET : AF_INET6, e->key, buf, size)) return buf;
+		buf[0] = 0;
+		return buf;
+	}
+	size_t n = e->len < size ? e->len : size - 1;
+	memcpy(buf, e->key, n);
+	buf[n] = 0;
+	return buf;
+}
+
+static int by_count(const void *a, const void *b) {
+	const struct topk_entry *x = a, *y = b;
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+size_t topk_get(enum topk_list l, struct topk_entry *out, size_t n) {
+	struct topk_entry e[TOPK_SIZE];
+	pthread_mutex_lock(&published_lock);
+	size_t used = published[l].used;
+	memcpy(e, published[l].e, used * sizeof *e);
+	pthread_mutex_unlock(&published_lock);
+	qsort(e, used, sizeof *e, by_count);
+	if(n > used) n = used;
+	memcpy(out, e, n * sizeof *e);
+	return n;
+}
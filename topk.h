@@ -0,0 +1,48 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stddef.h>
+
+#pragma RcB2 DEP "topk.c"
+
+/* heavy hitters: who opened the most connections and moved the most
+   bytes. each list is a Space-Saving summary (Metwally et al.) of
+   TOPK_SIZE counters, so memory is fixed no matter how many distinct
+   keys show up. a key that is in the real top TOPK_SIZE by a margin is
+   guaranteed to be listed; its count may be overestimated by at most
+   the reported error.
+
+   like the latency percentiles, the lists cover intervals: topk_interval()
+   publishes the summaries collected since the previous call and starts
+   over, and topk_get() reads the published ones. */
+
+#ifndef TOPK_SIZE
+#define TOPK_SIZE 32
+#endif
+#define TOPK_KEY 255
+
+enum topk_list {
+	TOP_CLIENT_CONNS, /* keys are the 4 or 16 address bytes */
+	TOP_CLIENT_BYTES,
+	TOP_DEST_CONNS,   /* keys are the requested host names */
+	TOP_DEST_BYTES,
+	TOP_MAX
+};
+
+struct topk_entry {
+	unsigned long long count, error;
+	unsigned char len;
+	unsigned char key[TOPK_KEY];
+};
+
+/* add weight to key, which is len (at most TOPK_KEY) bytes. */
+void topk_add(enum topk_list l, const void *key, size_t len, unsigned long long weight);
+void topk_interval(void);
+/* the key as text, for address keys the address. size should be at
+   least TOPK_KEY + 1. */
+char *topk_name(enum topk_list l, const struct topk_entry *e, char *buf, size_t size);
+/* copies up to n entries of the published list, largest count first,
+   and returns how many there were. */
+size_t topk_get(enum topk_list l, struct topk_entry *out, size_t n);
+
+#endif
@@ -0,0 +1,122 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include "trace.h"
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t trace_salt(void) {
+	uint64_t salt = 0;
+	int fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+	if(fd == -1 || read(fd, &salt, sizeof salt) != sizeof salt) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		salt = (uint64_t) ts.tv_sec * 1000000007ULL ^ ts.tv_nsec ^ (uint64_t) getpid() << 32;
+	}
+	if(fd != -1) close(fd);
+	return salt;
+}
+
+/* FNV-1a over the salt, the host and the port */
+uint32_t trace_hash(uint64_t salt, const char *host, unsigned port) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for(i = 0; i < 8; i++) h = (h ^ (salt >> i * 8 & 0xff)) * 0x100000001b3ULL;
+	for(; *host; host++) h = (h ^ (unsigned char) *host) * 0x100000001b3ULL;
+	h = (h ^ (port >> 8)) * 0x100000001b3ULL;
+	h = (h ^ (port & 0xff)) * 0x100000001b3ULL;
+	return h ^ h >> 32;
+}
+
+static void put_le(unsigned char *out, uint64_t v, int n) {
+	int i;
+	for(i = 0; i < n; i++) out[i] = v >> i * 8;
+}
+
+static uint64_t get_le(const unsigned char *in, int n) {
+	uint64_t v = 0;
+	int i;
+	for(i = 0; i < n; i++) v |= (uint64_t) in[i] << i * 8;
+	return v;
+}
+
+static size_t put_varint(unsigned char *out, uint64_t v) {
+	size_t n = 0;
+	while(v >= 0x80) {
+		out[n++] = v | 0x80;
+		v >>= 7;
+	}
+	out[n++] = v;
+	return n;
+}
+
+/* returns the varint's length, 0 if it runs past end or is too long */
+static size_t get_varint(const unsigned char *in, const unsigned char *end, uint64_t *v) {
+	size_t n = 0;
+	*v = 0;
+	while(in + n < end && n < 10) {
+		*v |= (uint64_t) (in[n] & 0x7f) << n * 7;
+		if(!(in[n++] & 0x80)) return n;
+	}
+	return 0;
+}
+
+void trace_header(unsigned char *out, uint64_t started) {
+	memcpy(out, TRACE_MAGIC, 8);
+	put_le(out + 8, started, 8);
+}
+
+int trace_check_header(const unsigned char *in, size_t len, uint64_t *started) {
+	if(len < TRACE_HEADER || memcmp(in, TRACE_MAGIC, 8)) return -1;
+	*started = get_le(in + 8, 8);
+	return 0;
+}
+
+size_t trace_encode(unsigned char *out, const struct trace_conn *c) {
+	size_t n = 2;
+	uint32_t mask = 0;
+	unsigned b, d;
+	n += put_varint(out + n, c->arrival);
+	n += put_varint(out + n, c->lifetime);
+	put_le(out + n, c->dest, 4);
+	n += 4;
+	out[n++] = c->flags;
+	out[n++] = c->reason;
+	for(b = 0; b < TRACE_BUCKETS; b++)
+		if(c->bytes[b][TRACE_UP] || c->bytes[b][TRACE_DOWN]) mask |= 1U << b;
+	n += put_varint(out + n, mask);
+	for(b = 0; b < TRACE_BUCKETS; b++)
+		if(mask & 1U << b) for(d = 0; d < 2; d++)
+			n += put_varint(out + n, c->bytes[b][d] < TRACE_BYTES_MAX ? c->bytes[b][d] : TRACE_BYTES_MAX);
+	put_le(out, n - 2, 2);
+	return n;
+}
+
+size_t trace_decode(const unsigned char *in, size_t len, struct trace_conn *c) {
+	const unsigned char *p = in + 2, *end;
+	uint64_t mask, v;
+	size_t n;
+	unsigned b, d;
+	if(len < 2) return 0;
+	end = p + get_le(in, 2);
+	if(end > in + len) return 0;
+	memset(c, 0, sizeof *c);
+#define VARINT(V) do { if(!(n = get_varint(p, end, &(V)))) return 0; p += n; } while(0)
+	VARINT(c->arrival);
+	VARINT(c->lifetime);
+	if(end - p < 6) return 0;
+	c->dest = get_le(p, 4);
+	c->flags = p[4];
+	c->reason = p[5];
+	p += 6;
+	VARINT(mask);
+	if(mask >> TRACE_BUCKETS) return 0;
+	for(b = 0; b < TRACE_BUCKETS; b++)
+		if(mask & 1U << b) for(d = 0; d < 2; d++) {
+			VARINT(v);
+			c->bytes[b][d] = v;
+		}
+#undef VARINT
+	return p == end ? end - in : 0;
+}
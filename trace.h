@@ -0,0 +1,84 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#pragma RcB2 DEP "trace.c"
+
+/* connection traces, recorded by microsocks -x and replayed by
+   microsocks-bench -r. a trace file is a header followed by one record
+   per closed connection, in the order they closed.
+
+   header: "mstrace1", then the wall clock time the trace started, in
+   microseconds since the epoch, as 8 bytes little endian.
+
+   record: its length in 2 bytes little endian, not counting these, then
+     varint   arrival, us since the trace started
+     varint   lifetime, us from accept to close
+     4 bytes  destination, a hash of host and port salted per trace, so
+              it tells destinations apart without naming them
+     1 byte   flags, see below
+     1 byte   close reason, as in the access log
+     varint   bitmap of the buckets that relayed anything
+     varints  bytes to and from the target, for every bucket in the bitmap
+   varints are unsigned LEB128.
+
+   bucket 0 holds the bytes relayed during the first TRACE_BUCKET_MS after
+   accept, bucket i > 0 those from TRACE_BUCKET_MS << (i-1) up to
+   TRACE_BUCKET_MS << i, and the last one everything after that. */
+
+#define TRACE_MAGIC "mstrace1"
+#define TRACE_HEADER 16
+#define TRACE_BUCKETS 20
+#define TRACE_BUCKET_MS 100
+/* bucket counts are capped so every record fits into TRACE_MAX bytes */
+#define TRACE_BYTES_MAX ((1ULL << 49) - 1)
+#define TRACE_MAX 320
+
+/* flags: the socks address type of the request, */
+#define TRACE_ATYP 0x07
+/* whether the client authenticated with a password, */
+#define TRACE_PASSWORD 0x08
+/* and whether the connection got to relaying. */
+#define TRACE_RELAYED 0x10
+
+enum trace_dir {
+	TRACE_UP, /* to the target */
+	TRACE_DOWN, /* from the target */
+};
+
+struct trace_conn {
+	uint64_t arrival, lifetime;
+	uint32_t dest;
+	unsigned char flags, reason;
+	uint64_t bytes[TRACE_BUCKETS][2];
+};
+
+static inline unsigned trace_bucket(unsigned long long ms) {
+	ms /= TRACE_BUCKET_MS;
+	if(!ms) return 0;
+	unsigned b = 64 - __builtin_clzll(ms);
+	return b < TRACE_BUCKETS ? b : TRACE_BUCKETS - 1;
+}
+
+/* when bucket b starts, in ms after accept */
+static inline unsigned long long trace_bucket_start(unsigned b) {
+	return b ? (unsigned long long) TRACE_BUCKET_MS << (b - 1) : 0;
+}
+
+/* a fresh salt for trace_hash(), from /dev/urandom if possible */
+uint64_t trace_salt(void);
+uint32_t trace_hash(uint64_t salt, const char *host, unsigned port);
+/* writes the TRACE_HEADER bytes of the header to out. */
+void trace_header(unsigned char *out, uint64_t started);
+/* returns 0 and the start time if in begins with a valid header. */
+int trace_check_header(const unsigned char *in, size_t len, uint64_t *started);
+/* writes the record for c to out, which has room for TRACE_MAX bytes.
+   returns its length. */
+size_t trace_encode(unsigned char *out, const struct trace_conn *c);
+/* reads the record at in into c. returns its length, or 0 if it is
+   truncated or malformed. */
+size_t trace_decode(const unsigned char *in, size_t len, struct trace_conn *c);
+
+#endif
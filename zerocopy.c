@@ -0,0 +1,169 @@
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+/* SO_ZEROCOPY, MSG_ZEROCOPY and IP_RECVERR */
+#define _DEFAULT_SOURCE
+#include "zerocopy.h"
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "bufpool.h"
+#include "clock.h"
+#include "sblist.h"
+#include "stats.h"
+
+struct parked {
+	struct zerocopy z;
+	unsigned long long since;
+	int reset;
+};
+
+static sblist parked = {.itemsize = sizeof (struct parked), .blockitems = 16};
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release(struct zerocopy *z, unsigned i) {
+	struct stats_shard *stats = stats_local();
+	bufpool_put(z->inflight[i].buf, z->inflight[i].cls);
+	if(z->inflight[i].copied) stats_add(stats, zerocopy_copied, z->inflight[i].len);
+	else stats_add(stats, zerocopy_sent, z->inflight[i].len);
+	z->inflight[i] = z->inflight[--z->count];
+}
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+void zerocopy_init(struct zerocopy *z, int fd, int enable) {
+	*z = (struct zerocopy) {.fd = fd};
+	z->on = enable && !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &(int){1}, sizeof(int));
+}
+
+int zerocopy_send(struct zerocopy *z, char **buf, unsigned cls, size_t n) {
+	uint32_t first = z->next;
+	size_t sent = 0;
+	ssize_t m;
+	while(sent < n) {
+		m = send(z->fd, *buf + sent, n - sent, MSG_ZEROCOPY);
+		if(m > 0) z->next++;
+		/* over optmem_max or RLIMIT_MEMLOCK, this one is copied */
+		else if(m == -1 && errno == ENOBUFS) m = write(z->fd, *buf + sent, n - sent);
+		if(m < 0) break;
+		sent += m;
+	}
+	if(z->next != first) {
+		z->inflight[z->count++] = (struct zerocopy_buf) {
+			.buf = *buf, .cls = cls, .len = n, .first = first, .ids = z->next - first};
+		*buf = 0;
+	}
+	return sent < n ? -1 : 0;
+}
+
+/* ids are counted back from the next one, which keeps the comparisons
+   right when they wrap around. */
+static int complete(struct zerocopy *z, uint32_t lo, uint32_t hi, int copied) {
+	uint32_t back_lo = z->next - lo, back_hi = z->next - hi;
+	unsigned i = 0;
+	int released = 0;
+	if(copied) z->on = 0;
+	while(i < z->count) {
+		uint32_t back_first = z->next - z->inflight[i].first;
+		uint32_t back_last = back_first - (z->inflight[i].ids - 1);
+		uint32_t from = back_lo < back_first ? back_lo : back_first;
+		uint32_t to = back_hi > back_last ? back_hi : back_last;
+		if(from >= to) {
+			z->inflight[i].done += from - to + 1;
+			z->inflight[i].copied |= copied;
+		}
+		if(z->inflight[i].done >= z->inflight[i].ids) {
+			release(z, i);
+			released++;
+		} else i++;
+	}
+	return released;
+}
+
+int zerocopy_reap(struct zerocopy *z) {
+	char control[128];
+	int released = 0;
+	while(z->count) {
+		struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof control};
+		struct cmsghdr *cm;
+		if(recvmsg(z->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) break;
+		for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *e = (void*) CMSG_DATA(cm);
+			if(!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+			   !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			if(e->ee_errno || e->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			released += complete(z, e->ee_info, e->ee_data,
+				e->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+		}
+	}
+	return released;
+}
+
+#else
+
+void zerocopy_init(struct zerocopy *z, int fd, int enable) {
+	(void) enable;
+	*z = (struct zerocopy) {.fd = fd};
+}
+
+int zerocopy_send(struct zerocopy *z, char **buf, unsigned cls, size_t n) {
+	(void) z; (void) buf; (void) cls; (void) n;
+	errno = ENOSYS;
+	return -1;
+}
+
+int zerocopy_reap(struct zerocopy *z) {
+	(void) z;
+	return 0;
+}
+
+#endif
+
+int zerocopy_ready(struct zerocopy *z) {
+	if(z->on && z->count == ZEROCOPY_INFLIGHT) zerocopy_reap(z);
+	return z->on && z->count < ZEROCOPY_INFLIGHT;
+}
+
+void zerocopy_finish(struct zerocopy *z) {
+	struct parked p = {.since = clock_ms()};
+	if(z->count) zerocopy_reap(z);
+	if(!z->count) return;
+	p.z = *z;
+	/* the completions go to the socket, so it must stay open */
+	if((p.z.fd = dup(z->fd)) == -1) {
+		/* reset it now, there is nothing else to do */
+		setsockopt(z->fd, SOL_SOCKET, SO_LINGER, &(struct linger) {1, 0}, sizeof(struct linger));
+		p.reset = 1;
+	} else shutdown(p.z.fd, SHUT_WR);
+	z->count = 0;
+	pthread_mutex_lock(&parked_lock);
+	if(!sblist_add(&parked, &p)) {
+		/* out of memory: the buffers are lost, but never reused */
+		if(!p.reset) close(p.z.fd);
+	}
+	pthread_mutex_unlock(&parked_lock);
+}
+
+void zerocopy_collect(unsigned long long now_ms) {
+	size_t i = 0;
+	pthread_mutex_lock(&parked_lock);
+	while(i < sblist_getsize(&parked)) {
+		struct parked *p = sblist_get(&parked, i);
+		if(!p->reset) {
+			zerocopy_reap(&p->z);
+			if(p->z.count && now_ms - p->since >= ZEROCOPY_PARK_MS) {
+				setsockopt(p->z.fd, SOL_SOCKET, SO_LINGER, &(struct linger) {1, 0}, sizeof(struct linger));
+				p->reset = 1;
+				p->since = now_ms;
+			}
+			if(!p->z.count || p->reset) close(p->z.fd);
+		} else if(now_ms - p->since >= ZEROCOPY_GRACE_MS)
+			while(p->z.count) release(&p->z, 0);
+		if(!p->z.count) sblist_delete(&parked, i);
+		else i++;
+	}
+	pthread_mutex_unlock(&parked_lock);
+}
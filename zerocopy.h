@@ -0,0 +1,62 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#pragma RcB2 DEP "zerocopy.c"
+
+/* sending relay buffers with MSG_ZEROCOPY (linux 4.14), for bulk flows
+   with -Z. the kernel pins the pages of the buffer instead of copying
+   them into the socket, and tells on the socket's error queue when it
+   is done with a range of sends. until then the buffer belongs to the
+   kernel, it only goes back to the pool (see bufpool.h) once every send
+   it was used for completed.
+   if the kernel had to copy after all, as it does for anything delivered
+   locally (loopback, veth) and for devices without scatter-gather, the
+   socket goes back to plain writes, pinning only costs extra then.
+   buffers still in flight when a connection ends are parked, along with
+   the socket, until their sends complete. after ZEROCOPY_PARK_MS the
+   socket is reset, which drops what it still queues, and the buffers
+   are kept for another ZEROCOPY_GRACE_MS before going back. */
+
+#define ZEROCOPY_INFLIGHT 8
+#define ZEROCOPY_PARK_MS (120*1000)
+#define ZEROCOPY_GRACE_MS (10*1000)
+
+struct zerocopy_buf {
+	char *buf;
+	unsigned cls;
+	size_t len;
+	/* the ids of the sends from this buffer, and how many of them
+	   completed */
+	uint32_t first, ids, done;
+	int copied;
+};
+
+struct zerocopy {
+	int fd, on;
+	/* the notification id of the next send */
+	uint32_t next;
+	unsigned count;
+	struct zerocopy_buf inflight[ZEROCOPY_INFLIGHT];
+};
+
+/* sets SO_ZEROCOPY on fd if enable is set. z stays off if that fails. */
+void zerocopy_init(struct zerocopy *z, int fd, int enable);
+/* whether the next send can go through zerocopy_send(). */
+int zerocopy_ready(struct zerocopy *z);
+/* sends the n bytes of *buf, a buffer of class cls from the pool. if any
+   of it went out with MSG_ZEROCOPY, the buffer is taken over and *buf
+   cleared. returns 0 if all of it was sent, -1 with errno set if not. */
+int zerocopy_send(struct zerocopy *z, char **buf, unsigned cls, size_t n);
+/* reads completions from the error queue without blocking, and hands
+   the buffers that are done back to the pool. returns how many. */
+int zerocopy_reap(struct zerocopy *z);
+/* for a connection that ends: parks what is still in flight. the socket
+   gets shut down for writing, as closing it would. */
+void zerocopy_finish(struct zerocopy *z);
+/* reaps the parked sockets, called by the timer thread. */
+void zerocopy_collect(unsigned long long now_ms);
+
+#endif